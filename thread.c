@@ -1,9 +1,30 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* accept4, MAP_STACK, MAP_NORESERVE */
+#endif
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ucontext.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <unistd.h>
 #include "thread.h"
 #include "interrupt.h"
+#include "thread_ext.h"
+
+/* lock_create is defined below, not the labelling macro */
+#undef lock_create
 
 /* Section 1. Data Structure */
 /* Wait queue structure */
@@ -21,18 +42,398 @@ typedef enum {
     SLEEP = 3
 } THREAD_STATUS;
 
-/* Thread control block */
+/* What a waker handed a sleeping thread along with the wakeup */
+typedef enum {
+    GRANT_LOCK,
+    GRANT_READ,
+    GRANT_WRITE,
+    GRANT_UNIT
+} GRANT_KIND;
+
+/* Saved register context */
+#ifdef THREAD_FAST_SWITCH
+/* Callee-saved registers are pushed on the thread's own stack, so only
+ * the stack pointer has to live in the TCB. */
+typedef struct {
+	void *sp;
+} threadContext;
+#else
+typedef ucontext_t threadContext;
+#endif
+
+/* Pending timeout of a sleeping thread, linked into one slot of the timer
+ * wheel */
+typedef struct timer {
+	unsigned long expires;		/* wheel tick it fires at */
+	struct timer *prev;
+	struct timer *next;
+	struct timer **slot;		/* head of the slot list, NULL when not pending */
+	struct thread *thread;
+} Timer;
+
+/* Thread control block, carved from tcbSlab. The first cache line holds
+ * what scheduling and queue walks touch; a ucontext_t is kept out of it in
+ * a block of its own from contextSlab. */
 typedef struct thread {
 	Tid id;
-	ucontext_t context;
-	void *stackPtr;
+	THREAD_STATUS state;
+	int priority;
+	int level;
+	/* MLFQ boosts level and the ready queue were last current for, see
+	 * Function 5.9 */
+	unsigned int levelEpoch;
+	unsigned int queueEpoch;
+	/* Set while a switch away from the thread is still saving its context,
+	 * see Function 5.21 */
+	int switching;
+	struct thread *prev;
 	struct thread *next;
-}threadNode;
+	struct wait_queue *queue;
+	struct worker *worker;
+#ifdef THREAD_FAST_SWITCH
+	threadContext context;
+#else
+	threadContext *context;
+#endif
+	unsigned long stamp;
+
+	void *stackPtr;
+	long stackSize;
+	char name[THREAD_NAME_MAX];
+	bool detached;
+	bool joinable;
+	bool exited;
+	Timer timer;
+	bool timedOut;
+	bool ioWait;
+	/* Address the thread sleeps on in thread_wait_on */
+	const int *waitAddr;
+	/* Channel cases the thread sleeps on in chan_select, and the one that
+	 * completed */
+	struct chanWaiter *chanWaiters;
+	int chanWaitCount;
+	int chanFired;
+	bool chanOk;
+	/* Thread-local storage slots, indexed by key */
+	void *specific[THREAD_KEYS_MAX];
+	/* Threads joining this one sleep in joinQueue; joiners counts those
+	 * that have not read retval yet, which keeps the exited TCB around, as
+	 * does joinable until the thread is joined. joining is the thread this
+	 * one is joining. */
+	struct wait_queue joinQueue;
+	int joiners;
+	struct thread *joining;
+	void *retval;
+	/* Lock, rwlock or semaphore handed over by a waker that the thread has
+	 * not taken yet, NULL when none */
+	void *grant;
+	GRANT_KIND grantKind;
+
+	/* Scheduler statistics, times in TSC cycles; stamp is above */
+	unsigned long switches;
+	unsigned long voluntary;
+	unsigned long preempted;
+	unsigned long cycles[SLEEP + 1];
+} __attribute__((aligned(64))) threadNode;
+
+/* Fixed size objects carved from SLAB_CHUNK byte chunks, recycled through
+ * a free list linked through their first word. Chunks are never returned,
+ * like the stacks in stackCache. */
+typedef struct slab {
+	size_t size;
+	void *free;
+	char *next;		/* unused part of the last chunk */
+	char *end;
+} Slab;
+
+/* One bit per priority level in Worker.readyMask */
+#if THREAD_PRIO_LEVELS > 32
+#error "THREAD_PRIO_LEVELS must fit in an unsigned int bitmap"
+#endif
+
+#if THREAD_WAIT_BUCKETS & (THREAD_WAIT_BUCKETS - 1)
+#error "THREAD_WAIT_BUCKETS must be a power of two"
+#endif
+
+/* Batches of threads woken up all at once, oldest first, that a worker
+ * has not got to yet. A full ring makes the worker finish the oldest. */
+#define WOKEN_BATCHES 8
+
+/* One wakeup of a whole queue, and what each of its threads was handed */
+typedef struct wokenBatch {
+	threadNode *last;	/* its last thread in Worker.woken */
+	unsigned long stamp;	/* when it was woken up */
+	void *grant;		/* NULL when nothing was handed over */
+	GRANT_KIND grantKind;
+} WokenBatch;
+
+/* Kernel thread running green threads, with the threads ready to run on it
+ * kept in one queue per priority level. Threads woken up all at once wait
+ * in woken, still marked as sleeping, until the worker gets to them;
+ * readyCount includes them. The ready queues, readyMask and readyCount are
+ * guarded by queueLockWord as well as the scheduler lock, so an idle
+ * worker can steal without the latter. */
+typedef struct worker {
+	threadNode *current;
+	threadQueue ready[THREAD_PRIO_LEVELS];
+	unsigned int readyMask;
+	int readyCount;
+	int queueLockWord;
+	threadQueue woken;
+	WokenBatch batches[WOKEN_BATCHES];
+	int batchHead;
+	int batchCount;
+	int ioSkips;		/* scheduling decisions since the last poll */
+	int tickPassed;		/* a tick passed on by another worker is on its way */
+	int parkWord;		/* 1 while parked on it, see Function 5.25 */
+	threadNode *switchFrom;	/* thread the last switch on this worker left */
+	threadNode idle;
+	pthread_t kthread;
+} Worker;
+
+/* One case of a thread blocked in chan_select, queued on the channel, or
+ * a pending future_send/future_recv, which has no thread */
+typedef struct chanWaiter {
+	threadNode *thread;
+	struct future *future;
+	int index;			/* case index in chan_select */
+	void *item;			/* item to send, or the one received */
+	struct chanWaiter *prev;
+	struct chanWaiter *next;
+	struct waiterList *list;
+} ChanWaiter;
+
+typedef struct waiterList {
+	ChanWaiter *head;
+	ChanWaiter *tail;
+} WaiterList;
+
+/* Bounded channel: a ring of capacity items, and the threads blocked
+ * sending while it is full or receiving while it is empty */
+typedef struct chan {
+	int capacity;
+	int head;
+	int count;
+	bool closed;
+	WaiterList senders;
+	WaiterList receivers;
+	void *buf[];
+} Chan;
+
+/* Stackless task, run to completion by one of the task runner threads.
+ * Exactly one of fn, then and async is set: a spawned function, a
+ * continuation of future, or a function whose result resolves result. A
+ * task queued with owns set holds that lock, and its runner takes it over
+ * before running it. */
+typedef struct task {
+	void (*fn)(void *arg);
+	void (*then)(void *arg, struct future *future);
+	void *(*async)(void *arg);
+	void *arg;
+	struct future *future;
+	struct future *result;
+	struct lock *owns;
+	unsigned long queued;		/* TSC when it started waiting for owns */
+	struct task *next;
+} Task;
+
+typedef struct taskList {
+	Task *head;
+	Task *tail;
+	int size;
+} TaskList;
+
+/* Future: a value set once, with the continuations to queue and the
+ * threads to wake when it is. refs counts the handles of the creator,
+ * of pending continuations and of the timer or channel completing it. */
+enum { FUTURE_PENDING = 0, FUTURE_RESOLVED = 1, FUTURE_FAILED = 2 };
+
+typedef struct future {
+	int state;
+	void *value;
+	int refs;
+	TaskList then;
+	threadQueue waiters;
+} Future;
+
+/* Timer resolving a future_sleep future, told apart from the timer of a
+ * thread by its NULL thread */
+typedef struct futureTimer {
+	Timer timer;
+	Future *future;
+} FutureTimer;
+
+/* Exited threads queued before thread_exit frees them; thread_create and
+ * idle workers free them whatever the count */
+#ifndef THREAD_REAP_BATCH
+#define THREAD_REAP_BATCH 16
+#endif
+
+/* Upper bound on exited stacks kept for reuse by thread_create */
+#ifndef THREAD_STACK_CACHE
+#define THREAD_STACK_CACHE 64
+#endif
+
+/* Pause iterations lock_acquire spins for while the owner runs on another
+ * worker, before it parks on the lock's wait queue */
+#ifndef THREAD_LOCK_SPIN
+#define THREAD_LOCK_SPIN 2000
+#endif
+
+/* Threads waiting for one file descriptor. seq counts the readiness events
+ * seen for it, so a waiter can tell whether one arrived since its last
+ * EAGAIN. */
+typedef struct fdWait {
+	threadQueue readers;
+	threadQueue writers;
+	unsigned int seq;
+	bool registered;
+	bool blocking;		/* a tty, or epoll refused it, as a regular file */
+	bool socket;		/* calls pass MSG_DONTWAIT, its flags are left alone */
+	bool nonblock;		/* O_NONBLOCK is set */
+	bool restore;		/* set by us, thread_close clears it again */
+} FdWait;
+
+/* How a wrapper makes its call on an fd, see ioBegin */
+enum { IO_NONBLOCK, IO_BLOCKING, IO_DONTWAIT };
+
+/* Reader-writer lock and semaphore state words: the low bits count readers
+ * (or semaphore units), RW_WRITER marks a writer holding the lock and
+ * SYNC_WAITERS that a thread may be asleep on one of the wait queues.
+ * Uncontended calls only do one atomic operation on the word; whoever
+ * finds SYNC_WAITERS set goes through the wait queues. */
+#define SYNC_WAITERS 0x80000000u
+#define RW_WRITER 0x40000000u
+
+/* Events taken from epoll per poll */
+#define POLL_EVENTS 64
+
+/* Scheduling decisions a worker makes at most between two polls while
+ * threads wait on I/O, for when no tick comes to poll */
+#ifndef THREAD_IO_POLL_EVERY
+#define THREAD_IO_POLL_EVERY 64
+#endif
+
+/* Microseconds per timer wheel tick */
+#ifndef THREAD_TIMER_TICK
+#define THREAD_TIMER_TICK 100
+#endif
+
+/* Timer wheel levels, each WHEEL_SLOTS times coarser than the one below.
+ * Four levels of 64 slots cover 2^24 ticks, longer timeouts are parked in
+ * the last level and reinserted as it turns. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* Events kept by the scheduler trace, a power of two */
+#ifndef THREAD_TRACE_EVENTS
+#define THREAD_TRACE_EVENTS (1 << 16)
+#endif
+
+/* Bytes of each slab chunk */
+#define SLAB_CHUNK (64 * 1024)
+
+/* Passes over the slots of an exiting thread, for destructors that set
+ * values again */
+#define KEY_DESTRUCTOR_ROUNDS 4
+#if THREAD_KEYS_MAX > 32
+#error "THREAD_KEYS_MAX must fit in an unsigned int bitmap"
+#endif
+
+/* Per kernel thread variable. Under the initial-exec model each access is
+ * a single %fs relative instruction, at an offset that is the same in every
+ * kernel thread, even when the library is built -fPIC; the default model
+ * there would call __tls_get_addr and keep the address of one kernel
+ * thread's copy. maskOff and the tick handlers rely on this. */
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
 
 /* Section 2. Global Variables */
-struct wait_queue readyQueue, exitQueue;
-struct wait_queue* waitQueue[THREAD_MAX_THREADS] = {NULL};
-THREAD_STATUS threads[THREAD_MAX_THREADS] = {EXIT};
+struct wait_queue exitQueue;
+/* Exited threads that still have joiners or are joinable */
+struct wait_queue heldQueue;
+/* TCB table, indexed by Tid and grown on demand up to maxThreads. A NULL
+ * TCB means the id is free. */
+threadNode** tcbTable = NULL;
+int tidCapacity = 0;
+int maxThreads = THREAD_MAX_THREADS;
+/* Tid bitmap: a bit of tidUsed is set while that id is taken, a bit of
+ * tidFull is set while that word of tidUsed is all ones */
+unsigned long *tidUsed = NULL;
+unsigned long *tidFull = NULL;
+/* Recycled stacks, linked through their highest word since the low pages
+ * are committed lazily */
+void *stackCache = NULL;
+int stackCacheSize = 0;
+/* Slabs of TCBs, their saved contexts and wait queues */
+Slab tcbSlab = {.size = sizeof(threadNode)};
+Slab contextSlab = {.size = sizeof(threadContext)};
+Slab queueSlab = {.size = sizeof(threadQueue)};
+void tcbFree(threadNode *node);
+/* Workers, workers[0] is the kernel thread that called thread_init */
+Worker workers[THREAD_MAX_WORKERS];
+int workerCount = 1;
+THREAD_LOCAL Worker *localWorker;
+/* Scheduling policy, see Section 5 */
+int schedPolicy = THREAD_SCHED_FIFO;
+/* Hand-off scheduling on lock_release and cv_signal, see Function 5.67 */
+bool handOffOn = false;
+int preemptTicks = 0;
+/* MLFQ boosts so far */
+unsigned int boostEpoch = 0;
+/* Scheduler lock, taken on top of interrupts_off() once workers are started */
+volatile int schedLockWord = 0;
+Worker *volatile schedOwner = NULL;
+/* Workers parked until a thread is queued for them to run or steal, and
+ * whether one of them also wakes up for the timer wheel */
+int parkedCount = 0;
+bool timerWatched = false;
+/* Timer wheel, wheelNow is the next tick to process */
+Timer *timerWheel[WHEEL_LEVELS][WHEEL_SLOTS];
+unsigned long wheelNow = 0;
+int timerCount = 0;
+/* I/O poller: epoll instance and wait queues indexed by fd, created on
+ * first use. ioWaiting counts threads sleeping on an fd. */
+int pollFd = -1;
+FdWait **fdTable = NULL;
+int fdCapacity = 0;
+int ioWaiting = 0;
+/* Threads sleeping in thread_wait_on, hashed by the address */
+threadQueue waitBuckets[THREAD_WAIT_BUCKETS];
+/* Threads in the woken queues of all workers */
+int wokenCount = 0;
+/* Thread-local storage keys in use, one bit each, and their destructors */
+unsigned int keyMask = 0;
+void (*keyDestructors[THREAD_KEYS_MAX])(void *);
+/* Tickless preemption: tickActive once a tick has come through
+ * thread_preempt from an interrupt layer that has interrupts_tick,
+ * tickArmed while its timer is running, tickQuantum its period and
+ * tickBusy while the current period has needed it */
+bool tickActive = false;
+bool tickArmed = false;
+bool tickBusy = false;
+long tickQuantum = SIG_INTERVAL;
+void tickUpdate();
+void tickTaken();
+/* Set, per kernel thread, for the yield a tick makes */
+THREAD_LOCAL volatile sig_atomic_t tickFlag;
+/* Scheduler trace: a ring of the last THREAD_TRACE_EVENTS events, written
+ * at traceHead while traceOn. The clock pair taken at thread_trace_start
+ * converts TSC stamps to time. */
+struct thread_trace_event traceRing[THREAD_TRACE_EVENTS];
+unsigned long traceHead = 0;
+bool traceOn = false;
+unsigned long traceStartTsc;
+struct timespec traceStartTime;
+/* Deferred masking, per kernel thread: maskFlag while in a critical
+ * section, maskPending for a tick that arrived meanwhile, maskBlocked while
+ * the signal is still blocked by the handler a switch came out of. */
+THREAD_LOCAL volatile sig_atomic_t maskFlag;
+THREAD_LOCAL volatile sig_atomic_t maskPending;
+THREAD_LOCAL bool maskBlocked;
+int maskOff();
+void maskSet(int enabled);
+Tid maskTick();
 
 /* Section 3. Queue Helper Functions */
 /**
@@ -41,6 +442,9 @@ THREAD_STATUS threads[THREAD_MAX_THREADS] = {EXIT};
  * @param node
  */
 void enqueueNode(threadQueue *q, threadNode *node) {
+    node->next = NULL;
+    node->prev = q->tail;
+    node->queue = q;
     if (q->head == NULL) {
         q->head = node;
         q->tail = node;
@@ -52,55 +456,100 @@ void enqueueNode(threadQueue *q, threadNode *node) {
 }
 
 /**
- * Function 3.2 Moves the target node to the head of the queue
- * @param q
- * @param target
- * @param prev
+ * Function 3.2 Unlinks the node from whichever queue holds it in O(1)
+ * @param node
  */
-void enqueueHead(threadQueue *q, threadNode *target, threadNode *prev) {
-    if (q->size <= 1 || target == q->head)
+void unlinkNode(threadNode *node) {
+    threadQueue *q = node->queue;
+    if (!q)
         return;
 
-    threadNode *prevHead = q->head;
-    q->head = target;
-    prev->next = target->next;
-
-    target->next = prevHead;
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        q->head = node->next;
 
-    if (q->tail == target){
-        q->tail = prev;
-    }
-}
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        q->tail = node->prev;
 
-/**
- * Function 3.3 Moves the head of the queue to the end
- * @param q
- */
-void enqueueEnd(threadQueue *q) {
-	if (q->size <= 1)
-		return;
-    threadNode *prevHead = q->head;
-	q->head = q->head->next;
-	q->tail->next = prevHead;
-	q->tail = prevHead;
-    prevHead->next = NULL;
+    node->prev = NULL;
+    node->next = NULL;
+    node->queue = NULL;
+    q->size--;
 }
 
 /**
- * Function 3.4 Removes and returns and the head of the queue
+ * Function 3.3 Removes and returns and the head of the queue
  * @param q
  * @return
  */
 threadNode* dequeue(threadQueue *q) {
     threadNode* prevHead = q->head;
-	q->head = q->head->next;
-    prevHead->next = NULL;
-	q->size--;
+    unlinkNode(prevHead);
 	return prevHead;
 }
 
 /**
- * Function 3.5 Frees all nodes in the given queue
+ * Function 3.4 Gets a stack of at least size bytes
+ * Stacks are mmap'ed with a PROT_NONE guard page below them, so an
+ * overflow faults instead of corrupting the neighbouring allocation. The
+ * mapping is not reserved up front, so pages a thread never touches take
+ * no memory. Stacks of the default size are recycled through stackCache.
+ * @param size
+ * @return lowest usable address, NULL when out of memory
+ */
+void* stackAlloc(long size) {
+    long page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    // Cached stacks are linked through their highest word, which a new
+    // thread touches first anyway
+    if (stackCache && size == (THREAD_MIN_STACK + page - 1) / page * page) {
+        char *stack = stackCache;
+        stackCache = *(void **)(stack + size - sizeof(void *));
+        stackCacheSize--;
+        return stack;
+    }
+
+    char *base = mmap(NULL, page + size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (mprotect(base, page, PROT_NONE)) {
+        munmap(base, page + size);
+        return NULL;
+    }
+    return base + page;
+}
+
+/**
+ * Function 3.5 Returns a stack to the cache, or unmaps it when the cache is
+ * full or the stack is not of the default size
+ * @param stack
+ * @param size as passed to stackAlloc
+ */
+void stackFree(void *stack, long size) {
+    if (!stack)
+        return;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    if (stackCacheSize < THREAD_STACK_CACHE && size == (THREAD_MIN_STACK + page - 1) / page * page) {
+        *(void **)((char *)stack + size - sizeof(void *)) = stackCache;
+        stackCache = stack;
+        stackCacheSize++;
+        return;
+    }
+
+    munmap((char *)stack - page, page + size);
+}
+
+/**
+ * Function 3.6 Frees all nodes in the given queue
  * @param q
  */
 void freeQueue(threadQueue *q) {
@@ -108,8 +557,8 @@ void freeQueue(threadQueue *q) {
 
 	while (q->head) {
         threadNode *next = q->head->next;
-        free(q->head->stackPtr);
-        free(q->head);
+        stackFree(q->head->stackPtr, q->head->stackSize);
+        tcbFree(q->head);
 		q->head = next;
 	}
 	q->tail = NULL;
@@ -117,511 +566,4335 @@ void freeQueue(threadQueue *q) {
 }
 
 /**
- * Function 3.6 Assign ID to a new Thread
- * @return
+ * Function 3.7 Grows the Tid indexed tables to hold at least count ids
+ * @param count
+ * @return false when out of memory
+ */
+bool growTables(int count) {
+    int cap = tidCapacity ? tidCapacity : 64;
+    while (cap < count)
+        cap *= 2;
+    if (cap == tidCapacity)
+        return true;
+
+    int words = cap / 64, fullWords = (words + 63) / 64;
+    int oldWords = tidCapacity / 64, oldFullWords = (oldWords + 63) / 64;
+    threadNode **tcbs = realloc(tcbTable, cap * sizeof(*tcbs));
+    if (tcbs)
+        tcbTable = tcbs;
+    unsigned long *used = realloc(tidUsed, words * sizeof(*used));
+    if (used)
+        tidUsed = used;
+    unsigned long *full = realloc(tidFull, fullWords * sizeof(*full));
+    if (full)
+        tidFull = full;
+    if (!tcbs || !used || !full)
+        return false;
+
+    for (int i = tidCapacity; i < cap; i++)
+        tcbTable[i] = NULL;
+    for (int i = oldWords; i < words; i++)
+        tidUsed[i] = 0;
+    for (int i = oldFullWords; i < fullWords; i++)
+        tidFull[i] = 0;
+    tidCapacity = cap;
+    return true;
+}
+
+/**
+ * Function 3.8 Assign ID to a new Thread
+ * Finds the lowest free id with two find-first-set steps over the bitmap.
+ * @return THREAD_NOMORE or THREAD_NOMEMORY when no id can be handed out
+ */
+Tid allocTid() {
+    int words = tidCapacity / 64;
+    int word = words;
+
+    for (int i = 0; i * 64 < words; i++) {
+        if (~tidFull[i]) {
+            word = i * 64 + __builtin_ctzl(~tidFull[i]);
+            break;
+        }
+    }
+
+    // Every word in the table is full: the next id is the first new one
+    Tid id = word < words ? word * 64 + __builtin_ctzl(~tidUsed[word]) : tidCapacity;
+    if (id >= maxThreads)
+        return THREAD_NOMORE;
+    if (id >= tidCapacity && !growTables(id + 1))
+        return THREAD_NOMEMORY;
+
+    word = id / 64;
+    tidUsed[word] |= 1UL << (id % 64);
+    if (!~tidUsed[word])
+        tidFull[word / 64] |= 1UL << (word % 64);
+    return id;
+}
+
+/**
+ * Function 3.9 Returns an id to the bitmap
+ * @param id
+ */
+void freeTid(Tid id) {
+    int word = id / 64;
+    tidUsed[word] &= ~(1UL << (id % 64));
+    tidFull[word / 64] &= ~(1UL << (word % 64));
+}
+
+/**
+ * Function 3.10 Moves a thread to a new state
+ * Charges the time spent in the old state to its statistics.
+ * @param node
+ * @param state
+ */
+void setState(threadNode *node, THREAD_STATUS state) {
+    unsigned long now = __builtin_ia32_rdtsc();
+
+    node->cycles[node->state] += now - node->stamp;
+    node->stamp = now;
+    node->state = state;
+}
+
+/**
+ * Function 3.11 Moves a thread to a new state as of when, a TSC stamp
+ * taken since its last change
+ * @param node
+ * @param state
+ * @param when
+ */
+void setStateAt(threadNode *node, THREAD_STATUS state, unsigned long when) {
+    node->cycles[node->state] += when - node->stamp;
+    node->stamp = when;
+    node->state = state;
+}
+
+/**
+ * Function 3.12 Looks up a live thread by id
+ * @param tid
+ * @return NULL when tid is out of range or not in use
+ */
+threadNode* lookupThread(Tid tid) {
+    if (tid < 0 || tid >= tidCapacity)
+        return NULL;
+    return tcbTable[tid];
+}
+
+/**
+ * Function 3.13 Retires a thread: releases its id and wakes up its waiters
+ * The node itself is left for the caller to queue on the exit queue.
+ * @param node
+ */
+void releaseExited(threadNode *node);
+void grantRevoke(threadNode *node);
+void retireThread(threadNode *node) {
+    setState(node, EXIT);
+    node->exited = true;
+
+    // Killed before it could take what a waker handed it
+    if (node->grant)
+        grantRevoke(node);
+
+    // A joinable thread keeps its id until it is joined or detached
+    if (!node->joinable) {
+        tcbTable[node->id] = NULL;
+        freeTid(node->id);
+    }
+
+    // Killed while joining, it will never read the exit value
+    if (node->joining) {
+        threadNode *target = node->joining;
+        node->joining = NULL;
+        target->joiners--;
+        releaseExited(target);
+    }
+
+    // Wakeup all threads waiting on this thread's exit
+    thread_wakeup(&node->joinQueue, 1);
+}
+
+/**
+ * Function 3.14 Records what a waker hands node, until it runs
+ * @param node
+ * @param kind
+ * @param obj the lock, rwlock or semaphore
+ */
+void grantTo(threadNode *node, GRANT_KIND kind, void *obj) {
+    node->grant = obj;
+    node->grantKind = kind;
+}
+
+/**
+ * Function 3.15 Moves every node of src to the end of dst in O(1)
+ * The nodes keep pointing at src as their queue, so they have to be taken
+ * off dst with the queue field fixed up, not with unlinkNode.
+ * @param dst
+ * @param src
+ */
+void spliceQueue(threadQueue *dst, threadQueue *src) {
+    if (!src->head)
+        return;
+
+    if (dst->tail) {
+        dst->tail->next = src->head;
+        src->head->prev = dst->tail;
+    } else {
+        dst->head = src->head;
+    }
+    dst->tail = src->tail;
+    dst->size += src->size;
+
+    src->head = src->tail = NULL;
+    src->size = 0;
+}
+
+/**
+ * Function 3.16 Frees the exited threads on the exit queue
+ * Those still joinable, or with joiners that have to read their exit value,
+ * are moved to the held queue instead, so later passes skip them.
+ */
+void reapExited() {
+    threadQueue busy = {0, NULL, NULL};
+
+    while (exitQueue.head) {
+        threadNode *node = dequeue(&exitQueue);
+        if (node->joiners || node->joinable) {
+            enqueueNode(&heldQueue, node);
+            continue;
+        }
+        // Still on its stack, switching away on another worker
+        if (__atomic_load_n(&node->switching, __ATOMIC_ACQUIRE)) {
+            enqueueNode(&busy, node);
+            continue;
+        }
+        stackFree(node->stackPtr, node->stackSize);
+        tcbFree(node);
+    }
+    while (busy.head)
+        enqueueNode(&exitQueue, dequeue(&busy));
+}
+
+/**
+ * Function 3.17 Moves a held exited thread back to the exit queue once
+ * nothing holds it any more
+ * @param node
+ */
+void releaseExited(threadNode *node) {
+    if (node->queue != &heldQueue || node->joiners || node->joinable)
+        return;
+    unlinkNode(node);
+    enqueueNode(&exitQueue, node);
+}
+
+/**
+ * Function 3.18 Gives up the id and exit value a joinable thread keeps
+ * after exiting, once it is joined or detached
+ * @param node
+ */
+void collectExited(threadNode *node) {
+    if (!node->joinable)
+        return;
+    node->joinable = false;
+    if (!node->exited)
+        return;
+
+    tcbTable[node->id] = NULL;
+    freeTid(node->id);
+    releaseExited(node);
+}
+
+/**
+ * Function 3.19 Appends an event to the trace ring, overwriting the oldest
+ * Runs inside a scheduler critical section, so one worker writes at a time.
+ * @param type THREAD_TRACE_*
+ * @param tid thread the event is about
+ * @param arg other thread, count or lock address, depending on type
+ */
+struct worker* currentWorker();
+void traceRecord(int type, Tid tid, long arg) {
+    struct thread_trace_event *ev = &traceRing[traceHead++ & (THREAD_TRACE_EVENTS - 1)];
+
+    ev->stamp = __builtin_ia32_rdtsc();
+    ev->arg = arg;
+    ev->tid = tid;
+    ev->type = type;
+    ev->worker = currentWorker() - workers;
+}
+
+/**
+ * Function 3.20 Takes an object from slab
+ * Chunks are cache line aligned, so objects whose size is a multiple of
+ * the line start on one.
+ * @param slab
+ * @return NULL when out of memory
+ */
+void* slabAlloc(Slab *slab) {
+    void *obj = slab->free;
+
+    if (obj) {
+        slab->free = *(void **)obj;
+        return obj;
+    }
+    if (slab->next + slab->size > slab->end) {
+        if (!(slab->next = aligned_alloc(64, SLAB_CHUNK)))
+            return NULL;
+        slab->end = slab->next + SLAB_CHUNK;
+    }
+    obj = slab->next;
+    slab->next += slab->size;
+    return obj;
+}
+
+/**
+ * Function 3.21 Returns an object to its slab
+ * @param slab
+ * @param obj
  */
-Tid minAvailableID(){
-    int i = 0;
-    while(i < THREAD_MAX_THREADS && threads[i]) i++;
-    return (i < THREAD_MAX_THREADS) ? i : THREAD_MAX_THREADS;
+void slabFree(Slab *slab, void *obj) {
+    if (!obj)
+        return;
+    *(void **)obj = slab->free;
+    slab->free = obj;
+}
+
+/**
+ * Function 3.22 Allocates a TCB, with the context block it needs
+ * @return NULL when out of memory
+ */
+threadNode* tcbAlloc() {
+    threadNode *node = slabAlloc(&tcbSlab);
+    if (!node)
+        return NULL;
+#ifndef THREAD_FAST_SWITCH
+    if (!(node->context = slabAlloc(&contextSlab))) {
+        slabFree(&tcbSlab, node);
+        return NULL;
+    }
+#endif
+    return node;
+}
+
+/**
+ * Function 3.23 Frees a TCB allocated by tcbAlloc
+ * @param node
+ */
+void tcbFree(threadNode *node) {
+#ifndef THREAD_FAST_SWITCH
+    slabFree(&contextSlab, node->context);
+#endif
+    slabFree(&tcbSlab, node);
+}
+
+/**
+ * Function 3.24 Puts node at the head of queue
+ * @param q
+ * @param node
+ */
+void prependNode(threadQueue *q, threadNode *node) {
+    node->prev = NULL;
+    node->next = q->head;
+    node->queue = q;
+    if (q->head)
+        q->head->prev = node;
+    else
+        q->tail = node;
+    q->head = node;
+    q->size++;
+}
+
+/* Records an event when tracing is on; a single branch otherwise */
+static inline void trace(int type, Tid tid, long arg) {
+    if (__builtin_expect(traceOn, 0))
+        traceRecord(type, tid, arg);
 }
 
-/* Section 4. Thread Library Functions */
+/* Section 4. Context Switch */
+void thread_stub(void (*thread_main)(void *), void *arg);
+
+#ifdef THREAD_FAST_SWITCH
 /*
- * Function 4.0 Stub
- * The First Thread Running Function
- * */
-void thread_stub(void (*thread_main)(void *), void *arg)
-{
-	interrupts_on();
-	thread_main(arg);
-	thread_exit();
+ * Build with -DTHREAD_FAST_SWITCH to switch threads with thread_swap below
+ * instead of getcontext/setcontext. Only the SysV callee-saved state is kept
+ * (rbx, rbp, r12-r15, the MXCSR and x87 control words, and rsp), and the
+ * signal mask is not touched: every switch happens with interrupts off and
+ * the resumed thread restores its own mask through maskSet().
+ */
+void thread_swap(void **saveSp, void *loadSp);
+void thread_trampoline(void);
+
+__asm__(
+    ".text\n"
+    ".globl thread_swap\n"
+    ".type thread_swap, @function\n"
+    "thread_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size thread_swap, .-thread_swap\n"
+    "\n"
+    /* First switch into a new thread lands here with the entry function in
+     * r14 and its arguments in r12 and r13 */
+    ".globl thread_trampoline\n"
+    ".type thread_trampoline, @function\n"
+    "thread_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    movq %r13, %rsi\n"
+    "    call *%r14\n"
+    "    ud2\n"
+    ".size thread_trampoline, .-thread_trampoline\n"
+);
+
+/* Initial frame popped by the first thread_swap into a new thread */
+typedef struct {
+	unsigned int mxcsr;
+	unsigned short fpcw;
+	unsigned short pad;
+	long r15, r14, r13, r12, rbx, rbp;
+	void (*ret)(void);
+} swapFrame;
+#endif
+
+/**
+ * Function 4.1 Prepares the context of a new thread to start in entry(fn, parg)
+ * @param node
+ * @param entry thread_stub for green threads
+ * @param fn
+ * @param parg
+ */
+void initContext(threadNode *node, void (*entry)(void (*)(void *), void *),
+                 void (*fn) (void *), void *parg) {
+#ifdef THREAD_FAST_SWITCH
+    // Keep rsp 16-byte aligned at the call in thread_trampoline
+    long top = ((long)node->stackPtr + node->stackSize) & ~15L;
+    swapFrame *frame = (swapFrame *)(top - 16) - 1;
+
+    frame->mxcsr = 0x1F80;
+    frame->fpcw = 0x037F;
+    frame->r12 = (long)fn;
+    frame->r13 = (long)parg;
+    frame->r14 = (long)entry;
+    frame->r15 = frame->rbx = frame->rbp = 0;
+    frame->ret = thread_trampoline;
+    node->context.sp = frame;
+#else
+	getcontext(node->context);
+
+    node->context->uc_mcontext.gregs[REG_RDI] = (long long int)fn;
+    node->context->uc_mcontext.gregs[REG_RSI] = (long long int)parg;
+    node->context->uc_mcontext.gregs[REG_RSP] = (((long long int)node->stackPtr + node->stackSize) & ~15LL) - 8;
+    node->context->uc_mcontext.gregs[REG_RIP] = (long long int)entry;
+#endif
+}
+
+/**
+ * Function 4.2 Saves the context of curr and resumes next
+ * Returns once another thread switches back to curr.
+ * @param curr
+ * @param next
+ */
+void switchThread(threadNode *curr, threadNode *next) {
+#ifdef THREAD_FAST_SWITCH
+    thread_swap(&curr->context.sp, next->context.sp);
+#else
+    // Flag to check if returning from a different thread
+    volatile bool isCalled = false;
+
+    getcontext(curr->context);
+
+    // Returning to this thread from a different thread
+    if (!isCalled) {
+        isCalled = true;
+        setcontext(next->context);
+    }
+#endif
+}
+
+/**
+ * Function 4.3 Resumes next without keeping the current context
+ * @param curr exiting thread, its stack stays valid until it is freed
+ * @param next
+ */
+void jumpThread(threadNode *curr, threadNode *next) {
+#ifdef THREAD_FAST_SWITCH
+    thread_swap(&curr->context.sp, next->context.sp);
+#else
+    (void)curr;
+	setcontext(next->context);
+#endif
+}
+
+/* Section 5. Workers */
+/* Flag or'ed into the value returned by schedOff when it took the lock */
+#define SCHED_LOCKED 2
+
+/**
+ * Function 5.1 Returns the worker running the calling code
+ * Never inlined: a green thread may resume on a different kernel thread
+ * after a switch, so the TLS lookup must not be cached across one.
+ * @return
+ */
+__attribute__((noinline)) Worker* currentWorker() {
+    __asm__ volatile("" ::: "memory");
+    return localWorker;
+}
+
+/**
+ * Function 5.2 Spins until the scheduler lock is taken by w
+ * @param w
+ */
+void schedLock(Worker *w) {
+    int spins = 0;
+    while (__atomic_exchange_n(&schedLockWord, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&schedLockWord, __ATOMIC_RELAXED)) {
+            if (++spins % 128 == 0)
+                sched_yield();
+            else
+                __builtin_ia32_pause();
+        }
+    }
+    schedOwner = w;
+}
+
+/**
+ * Function 5.3 Releases the scheduler lock
+ */
+void schedUnlock() {
+    schedOwner = NULL;
+    __atomic_store_n(&schedLockWord, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function 5.4.1 Spins until the run queues of w are taken
+ * Nests inside the scheduler lock, never the other way round; two workers'
+ * queues are taken in the order of the workers.
+ * @param w
+ */
+void queueLock(Worker *w) {
+    if (workerCount == 1)
+        return;
+    while (__atomic_exchange_n(&w->queueLockWord, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&w->queueLockWord, __ATOMIC_RELAXED))
+            __builtin_ia32_pause();
+    }
+}
+
+/**
+ * Function 5.5.2 Releases the run queues of w
+ * @param w
+ */
+void queueUnlock(Worker *w) {
+    if (workerCount == 1)
+        return;
+    __atomic_store_n(&w->queueLockWord, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function 5.6 Enters a scheduler critical section
+ * Same contract as interrupts_off(); with more than one worker it also
+ * takes the scheduler lock unless this worker already holds it.
+ * The library makes every heap call inside one: a tick switching threads
+ * in the middle of malloc would let another thread into it on the same
+ * kernel thread. What a tick runs, timer callbacks included, is inside a
+ * critical section too, so it can never interrupt one of those calls.
+ * @return state to hand back to schedSet
+ */
+int schedOff() {
+    int state = maskOff();
+
+    if (workerCount > 1) {
+        Worker *w = currentWorker();
+        if (schedOwner != w) {
+            schedLock(w);
+            state |= SCHED_LOCKED;
+        }
+    }
+    return state;
+}
+
+/**
+ * Function 5.7 Leaves a scheduler critical section entered by schedOff
+ * @param state
+ */
+void schedSet(int state) {
+    // Leaving the outermost section, the set of ready threads may have changed
+    if (state & 1)
+        tickUpdate();
+    if (state & SCHED_LOCKED)
+        schedUnlock();
+    maskSet(state & 1);
+}
+
+/**
+ * Function 5.8 Level a ready thread is queued at under each policy
+ * Level 0 runs first. FIFO keeps everyone on one level, PRIORITY uses the
+ * static priority and MLFQ the level the thread has been demoted to.
+ * @param node
+ * @return
+ */
+int fifoLevel(threadNode *node) { (void)node; return 0; }
+int priorityLevel(threadNode *node) { return node->priority; }
+int mlfqLevel(threadNode *node) {
+    if (node->levelEpoch != boostEpoch) {
+        node->level = node->priority;
+        node->levelEpoch = boostEpoch;
+    }
+    return node->level;
+}
+
+/**
+ * Function 5.9 Charges a thread giving up the CPU under each policy
+ * MLFQ demotes a thread that was preempted, i.e. used its whole quantum,
+ * and every THREAD_MLFQ_BOOST preemptions lifts everyone back to their
+ * static priority so demoted threads cannot starve. A boost costs
+ * O(levels): it bumps boostEpoch, which mlfqLevel takes as the cue to
+ * reset a thread's level, and splices each worker's ready queues onto
+ * level 0. So a thread ready at the boost gets its next run from the top
+ * level, and is queued at its static priority after that. Its queue field
+ * still names the level it was queued at; removeReady fixes that up.
+ * @param node
+ * @param preempted
+ */
+void noAccount(threadNode *node, bool preempted) { (void)node; (void)preempted; }
+void requeueReady();
+void timerAdvance();
+void ioPoll(Worker *w, long usec);
+void chanUnwait(threadNode *node);
+void wokenAdd(Worker *w, threadQueue *q, GRANT_KIND kind, void *grant);
+void futureTimerFire(FutureTimer *ft);
+void futureChanDone(ChanWaiter *cw, bool ok);
+void wokenDrain(Worker *w, int count);
+void wokenReady(Worker *w);
+void wokenFlush();
+void mlfqAccount(threadNode *node, bool preempted) {
+    if (!preempted)
+        return;
+    if (mlfqLevel(node) < THREAD_PRIO_LEVELS - 1)
+        node->level++;
+
+    if (++preemptTicks % THREAD_MLFQ_BOOST == 0) {
+        boostEpoch++;
+        for (int i = 0; i < workerCount; i++) {
+            Worker *w = &workers[i];
+            queueLock(w);
+            for (int level = 1; level < THREAD_PRIO_LEVELS; level++)
+                spliceQueue(&w->ready[0], &w->ready[level]);
+            if (w->readyMask)
+                w->readyMask = 1;
+            queueUnlock(w);
+        }
+    }
+}
+
+/* Policy table indexed by THREAD_SCHED_* */
+struct schedOps {
+    int (*level)(threadNode *node);
+    void (*account)(threadNode *node, bool preempted);
+} schedOps[] = {
+    [THREAD_SCHED_FIFO] = {fifoLevel, noAccount},
+    [THREAD_SCHED_PRIORITY] = {priorityLevel, noAccount},
+    [THREAD_SCHED_MLFQ] = {mlfqLevel, mlfqAccount},
+};
+
+/**
+ * Function 5.10 Puts node on the ready queue of w for its policy level
+ * Runs with the run queues of w taken.
+ * @param w
+ * @param node
+ */
+void readyPush(Worker *w, threadNode *node) {
+    int level = schedOps[schedPolicy].level(node);
+
+    node->worker = w;
+    node->queueEpoch = boostEpoch;
+    enqueueNode(&w->ready[level], node);
+    w->readyMask |= 1u << level;
+    w->readyCount++;
+}
+
+/**
+ * Function 5.11.1 Takes the first or last thread of the best ready level of w
+ * Runs with the run queues of w taken.
+ * @param w
+ * @param last
+ * @return NULL when nothing is on the ready queues
+ */
+threadNode* readyPop(Worker *w, bool last) {
+    if (!w->readyMask)
+        return NULL;
+
+    threadQueue *q = &w->ready[__builtin_ctz(w->readyMask)];
+    threadNode *node = last ? q->tail : q->head;
+
+    // May still name the level an MLFQ boost spliced it off
+    node->queue = q;
+    unlinkNode(node);
+    if (!q->size)
+        w->readyMask &= ~(1u << (q - w->ready));
+    w->readyCount--;
+    return node;
+}
+
+void workerWake(Worker *w);
+
+/**
+ * Function 5.12.2 Queues a ready thread on w at its policy level
+ * @param w
+ * @param node
+ */
+void enqueueReady(Worker *w, threadNode *node) {
+    setState(node, READY);
+    queueLock(w);
+    readyPush(w, node);
+    queueUnlock(w);
+    workerWake(w);
+}
+
+/**
+ * Function 5.13 Unlinks a ready thread from the worker holding it
+ * The thread may be stolen meanwhile, so its worker is checked again once
+ * its run queues are taken.
+ * @param node
+ */
+void removeReady(threadNode *node) {
+    Worker *w = node->worker;
+
+    queueLock(w);
+    while (node->worker != w) {
+        queueUnlock(w);
+        w = node->worker;
+        queueLock(w);
+    }
+
+    // Spliced onto level 0 by an MLFQ boost since it was queued
+    if (node->queueEpoch != boostEpoch)
+        node->queue = &w->ready[0];
+    threadQueue *q = node->queue;
+
+    unlinkNode(node);
+    if (!q->size)
+        w->readyMask &= ~(1u << (q - w->ready));
+    w->readyCount--;
+    queueUnlock(w);
+}
+
+/**
+ * Function 5.14 Level of the best ready thread on w, found with one bit scan
+ * @param w
+ * @return THREAD_PRIO_LEVELS when nothing is ready
+ */
+int bestLevel(Worker *w) {
+    return w->readyMask ? __builtin_ctz(w->readyMask) : THREAD_PRIO_LEVELS;
+}
+
+/**
+ * Function 5.15 Requeues every ready thread after levels or the policy change
+ */
+void requeueReady() {
+    wokenFlush();
+    for (int i = 0; i < workerCount; i++) {
+        Worker *w = &workers[i];
+        threadQueue all = {0, NULL, NULL};
+        threadNode *node;
+
+        queueLock(w);
+        while ((node = readyPop(w, false)))
+            enqueueNode(&all, node);
+        while (all.head)
+            readyPush(w, dequeue(&all));
+        queueUnlock(w);
+    }
+}
+
+/**
+ * Function 5.16 Counts running and ready threads over all workers
+ * The run queues are all taken, so a steal cannot hide threads in flight.
+ * @return
+ */
+int runnableCount() {
+    int count = 0;
+    for (int i = 0; i < workerCount; i++)
+        queueLock(&workers[i]);
+    for (int i = 0; i < workerCount; i++) {
+        count += workers[i].readyCount + (workers[i].current != NULL);
+        queueUnlock(&workers[i]);
+    }
+    return count;
+}
+
+/**
+ * Function 5.17 Busiest worker other than w, by ready threads
+ * Read without the run queues taken, so only a hint.
+ * @param w
+ * @param woken whether threads still to be woken count
+ * @return NULL when no other worker has any
+ */
+Worker* stealVictim(Worker *w, bool woken) {
+    Worker *victim = NULL;
+    int self = w - workers, most = 0;
+
+    for (int i = 1; i < workerCount; i++) {
+        Worker *v = &workers[(self + i) % workerCount];
+        int ready = __atomic_load_n(&v->readyCount, __ATOMIC_RELAXED);
+        if (!woken)
+            ready -= v->woken.size;
+        if (ready > most) {
+            victim = v;
+            most = ready;
+        }
+    }
+    return victim;
+}
+
+/**
+ * Function 5.18.1 Moves half of the threads on the ready queues of victim
+ * to w, best levels first. Running threads are never taken, nor woken ones,
+ * whose wakeup only the scheduler lock may finish. Needs only the run
+ * queues, so a parked worker can steal without the scheduler lock.
+ * @param w
+ * @param victim
+ * @return whether anything was stolen
+ */
+bool stealFrom(Worker *w, Worker *victim) {
+    Worker *first = victim < w ? victim : w;
+    queueLock(first);
+    queueLock(first == w ? victim : w);
+
+    int count = (victim->readyCount - victim->woken.size + 1) / 2, stolen = 0;
+    threadNode *node;
+    while (stolen < count && (node = readyPop(victim, true))) {
+        readyPush(w, node);
+        stolen++;
+    }
+
+    queueUnlock(victim);
+    queueUnlock(w);
+    return stolen > 0;
+}
+
+/**
+ * Function 5.19.2 Steals for w under the scheduler lock, which also lets
+ * the victim's woken threads be taken
+ * @param w
+ * @return whether anything was stolen
+ */
+bool stealInto(Worker *w) {
+    Worker *victim = stealVictim(w, true);
+    if (!victim)
+        return false;
+
+    wokenDrain(victim, victim->woken.size);
+    return stealFrom(w, victim);
+}
+
+/**
+ * Function 5.20 Removes the next thread to run on w, stealing if needed
+ * @param w
+ * @return NULL when no thread is ready anywhere
+ */
+threadNode* pickNext(Worker *w) {
+    // Threads that never yield to a tick or run dry would keep I/O
+    // waiters parked for good
+    if (ioWaiting && ++w->ioSkips >= THREAD_IO_POLL_EVERY)
+        ioPoll(w, 0);
+
+    if (!w->readyCount && !stealInto(w))
+        return NULL;
+
+    wokenReady(w);
+    queueLock(w);
+    // A parked worker may have stolen everything meanwhile
+    threadNode *node = readyPop(w, false);
+    queueUnlock(w);
+    return node;
+}
+
+/**
+ * Function 5.21 Makes next the running thread of w and switches to it
+ * @param w
+ * @param curr
+ * @param next NULL to switch to the idle context of w, or curr itself when
+ *             its timed sleep ran out before anything else was ready
+ */
+void switchBegin(Worker *w, threadNode *curr, threadNode *next);
+void switchEnd();
+void runNext(Worker *w, threadNode *curr, threadNode *next) {
+    w->current = next;
+    if (next) {
+        setState(next, RUNNING);
+        next->switches++;
+    }
+    tickUpdate();
+    if (next == curr)
+        return;
+
+    if (!next)
+        next = &w->idle;
+    switchBegin(w, curr, next);
+    switchThread(curr, next);
+    switchEnd();
+}
+
+/**
+ * Function 5.22.1 Drops the scheduler lock for a switch from curr to next
+ * The lock is not held across the switch itself. curr stays marked until
+ * the side switched to has seen its context saved, and a worker about to
+ * run a marked thread waits for that; next may be one switched away from
+ * on another worker a moment ago.
+ * @param w
+ * @param curr
+ * @param next
+ */
+void switchBegin(Worker *w, threadNode *curr, threadNode *next) {
+    if (workerCount == 1)
+        return;
+
+    while (__atomic_load_n(&next->switching, __ATOMIC_ACQUIRE))
+        __builtin_ia32_pause();
+    curr->switching = 1;
+    w->switchFrom = curr;
+    schedUnlock();
+}
+
+/**
+ * Function 5.23.2 Finishes a switch on the side switched to
+ * Clears the mark of the thread switched away from before waiting for the
+ * scheduler lock, which its next worker may be holding while it waits.
+ */
+void switchEnd() {
+    if (workerCount == 1)
+        return;
+
+    Worker *w = currentWorker();
+    __atomic_store_n(&w->switchFrom->switching, 0, __ATOMIC_RELEASE);
+    schedLock(w);
+}
+
+/**
+ * Function 5.24 Wakes a parked worker for a thread just queued on w
+ * w itself if it is parked, any other to steal the thread otherwise.
+ * Runs with the scheduler lock held.
+ * @param w
+ */
+void workerWake(Worker *w) {
+    if (!parkedCount)
+        return;
+
+    Worker *p = w;
+    for (int i = 0; !p->parkWord; i++)
+        p = &workers[i];
+    parkedCount--;
+    __atomic_store_n(&p->parkWord, 0, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &p->parkWord, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Function 5.25 Parks an idle worker until workerWake
+ * While timers are pending, one parked worker also wakes up at each wheel
+ * tick, and passes that on to another when it leaves for a thread.
+ * Called with the scheduler lock held; it is dropped while parked. Ready
+ * threads of other workers are stolen without it, before blocking and
+ * once woken, so only running one needs the lock.
+ * @param w
+ */
+void workerPark(Worker *w) {
+    struct timespec tick = {0, THREAD_TIMER_TICK * 1000};
+    bool timed = timerCount && !timerWatched;
+    bool expired = false;
+
+    w->parkWord = 1;
+    parkedCount++;
+    timerWatched |= timed;
+    schedUnlock();
+
+    for (;;) {
+        Worker *victim = stealVictim(w, false);
+        if (w->readyCount || (victim && stealFrom(w, victim)))
+            break;
+        if (!__atomic_load_n(&w->parkWord, __ATOMIC_ACQUIRE))
+            break;
+        if (syscall(SYS_futex, &w->parkWord, FUTEX_WAIT_PRIVATE, 1,
+                    timed ? &tick : NULL, NULL, 0) < 0 && errno == ETIMEDOUT) {
+            expired = true;
+            break;
+        }
+    }
+
+    schedLock(w);
+    if (w->parkWord) {
+        w->parkWord = 0;
+        parkedCount--;
+    }
+    if (timed) {
+        timerWatched = false;
+        if (!expired && timerCount)
+            workerWake(w);
+    }
+}
+
+/**
+ * Function 5.26 Scheduler loop a worker runs whenever it has no thread
+ * Runs with the scheduler lock held and interrupts off.
+ * @param w
+ */
+void workerLoop(Worker *w) {
+    for (;;) {
+        if (timerCount)
+            timerAdvance();
+
+        threadNode *next = pickNext(w);
+        if (next) {
+            runNext(w, &w->idle, next);
+            continue;
+        }
+
+        // Nothing to run, clean up and let the other workers at the lock
+        reapExited();
+        if (ioWaiting)
+            ioPoll(w, THREAD_TIMER_TICK);
+        else
+            workerPark(w);
+    }
+}
+
+/**
+ * Function 5.27 Entry of the idle context of workers[0]
+ * @param unused
+ * @param arg
+ */
+void workerStub(void (*unused)(void *), void *arg) {
+    (void)unused;
+    switchEnd();
+    workerLoop((Worker *)arg);
+}
+
+/**
+ * Function 5.28 Entry of the kernel threads started by thread_start_workers
+ * Their idle context is their own pthread stack.
+ * @param arg
+ * @return
+ */
+void* workerMain(void *arg) {
+    Worker *w = (Worker *)arg;
+
+    maskOff();
+    localWorker = w;
+#ifdef THREAD_DEFERRED_MASK
+    // Ticks reach this kernel thread too, the flag keeps them out
+    interrupts_on();
+#endif
+    schedLock(w);
+    workerLoop(w);
+    return NULL;
+}
+
+/**
+ * Function 5.29 Passes a timer tick on to the other workers
+ * The timer signal is sent to the process, which hands it to a single
+ * kernel thread, nearly always the same one, so threads on the other
+ * workers would never be preempted. A worker is marked before a tick is
+ * passed to it, and such a tick goes no further. Runs in the signal
+ * handler.
+ */
+void tickForward() {
+    if (workerCount == 1 || !localWorker)
+        return;
+    if (__atomic_exchange_n(&localWorker->tickPassed, 0, __ATOMIC_RELAXED))
+        return;
+
+    for (int i = 0; i < workerCount; i++) {
+        Worker *w = &workers[i];
+        if (w != localWorker && w->current) {
+            __atomic_store_n(&w->tickPassed, 1, __ATOMIC_RELAXED);
+            pthread_kill(w->kthread, SIG_TYPE);
+        }
+    }
+}
+
+/**
+ * Function 5.30 Current time in wheel ticks
+ * @return
+ */
+unsigned long timerNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (1000000 / THREAD_TIMER_TICK) + ts.tv_nsec / (1000 * THREAD_TIMER_TICK);
+}
+
+/**
+ * Function 5.31 Wheel tick by which at least usec microseconds have passed
+ * @param usec
+ * @return
+ */
+unsigned long timerDeadline(long usec) {
+    // One extra tick for the part of the current one already gone
+    return timerNow() + (usec + THREAD_TIMER_TICK - 1) / THREAD_TIMER_TICK + 1;
+}
+
+/**
+ * Function 5.32 Links a timer into the slot its expiry falls in, in O(1)
+ * The level is the coarsest one whose slots are no wider than the time
+ * left, so the timer is cascaded down as its expiry gets close.
+ * @param t
+ */
+void timerInsert(Timer *t) {
+    unsigned long expires = t->expires < wheelNow ? wheelNow : t->expires;
+    unsigned long delta = expires - wheelNow;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >> ((level + 1) * WHEEL_BITS))
+        level++;
+    if (delta >> (WHEEL_LEVELS * WHEEL_BITS))
+        expires = wheelNow + (1UL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+
+    Timer **slot = &timerWheel[level][(expires >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot)
+        (*slot)->prev = t;
+    *slot = t;
+    t->slot = slot;
+}
+
+/**
+ * Function 5.33 Unlinks a timer from its slot in O(1)
+ * @param t
+ */
+void timerUnlink(Timer *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *t->slot = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    t->slot = NULL;
+}
+
+/**
+ * Function 5.34 Arms a timer to fire at wheel tick expires
+ * @param t
+ * @param expires
+ */
+void timerAdd(Timer *t, unsigned long expires) {
+    // An empty wheel may be far behind, restart it from now
+    if (!timerCount)
+        wheelNow = timerNow();
+    t->expires = expires;
+    timerInsert(t);
+    // Parked workers only wait for threads to be queued, one of them is to
+    // keep the wheel going
+    if (!timerCount++)
+        workerWake(currentWorker());
+}
+
+/**
+ * Function 5.35 Disarms a timer, if it is pending
+ * @param t
+ */
+void timerCancel(Timer *t) {
+    if (!t->slot)
+        return;
+    timerUnlink(t);
+    timerCount--;
+}
+
+/**
+ * Function 5.36 Runs the wheel up to the current tick
+ * Expired timers wake their thread up on this worker, with timedOut set.
+ * Called from the timer interrupt, through thread_yield, and from idle
+ * workers.
+ */
+void timerAdvance() {
+    unsigned long now = timerNow();
+
+    while (timerCount && wheelNow <= now) {
+        // Move the timers of every coarser slot that comes due at this tick
+        // one or more levels down
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheelNow & ((1UL << (level * WHEEL_BITS)) - 1))
+                break;
+
+            Timer **slot = &timerWheel[level][(wheelNow >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+            while (*slot) {
+                Timer *t = *slot;
+                timerUnlink(t);
+                timerInsert(t);
+            }
+        }
+
+        // Expiring a thread that was woken up in a batch would find it on
+        // the wrong queue
+        Timer **slot = &timerWheel[0][wheelNow & (WHEEL_SLOTS - 1)];
+        if (*slot && wokenCount)
+            wokenFlush();
+        while (*slot) {
+            Timer *t = *slot;
+            timerUnlink(t);
+
+            // Parked beyond the end of the wheel, not due yet
+            if (t->expires > wheelNow) {
+                timerInsert(t);
+                continue;
+            }
+
+            timerCount--;
+            threadNode *node = t->thread;
+            if (!node) {
+                futureTimerFire((FutureTimer *)t);
+                continue;
+            }
+            unlinkNode(node);
+            node->timedOut = true;
+            enqueueReady(currentWorker(), node);
+        }
+        wheelNow++;
+    }
+    if (!timerCount)
+        wheelNow = now + 1;
+}
+
+/**
+ * Function 5.37 Like pickNext, but waits for pending timers and I/O when
+ * nothing is ready and there is no idle context to wait in
+ * With one worker the thread giving up the CPU naps on its own stack until
+ * a timer or the poller makes a thread ready, possibly itself. Waiting for
+ * I/O alone blocks in epoll until an fd is ready.
+ * @param w
+ * @return NULL when no thread is ready and none can become ready here
+ */
+threadNode* pickNextWait(Worker *w) {
+    struct timespec nap = {0, THREAD_TIMER_TICK * 1000};
+    threadNode *next;
+
+    while (!(next = pickNext(w)) && workerCount == 1 && (timerCount || ioWaiting)) {
+        if (ioWaiting)
+            ioPoll(w, timerCount ? THREAD_TIMER_TICK : -1);
+        else
+            nanosleep(&nap, NULL);
+        if (timerCount)
+            timerAdvance();
+    }
+    return next;
+}
+
+/**
+ * Function 5.38 Puts the running thread to sleep on queue until it is
+ * woken up or, unless expires is 0, the wheel reaches expires
+ * Runs inside a scheduler critical section.
+ * @param queue NULL to sleep on the timer alone
+ * @param expires
+ * @return id of the thread run next, THREAD_NONE when it did not sleep
+ *         since nothing could ever wake it up
+ */
+Tid sleepCurrent(threadQueue *queue, unsigned long expires) {
+    Worker *w = currentWorker();
+    threadNode *curr = w->current;
+
+    // Killed while running on another worker
+    if (curr->state == EXIT)
+        thread_exit();
+
+    if (queue)
+        enqueueNode(queue, curr);
+    setState(curr, SLEEP);
+    curr->voluntary++;
+    curr->timedOut = false;
+    if (expires)
+        timerAdd(&curr->timer, expires);
+
+    // Run the next local or stolen thread, or go idle while others run
+    threadNode *next = pickNextWait(w);
+
+    // With one worker there is no idle context to wait in. The timers
+    // that kept us going may have had no thread behind them, as those of
+    // future_sleep, and woke nobody: take the sleep back
+    if (!next && workerCount == 1) {
+        if (queue)
+            unlinkNode(curr);
+        timerCancel(&curr->timer);
+        setState(curr, RUNNING);
+        curr->voluntary--;
+        return THREAD_NONE;
+    }
+
+    Tid ret = next ? next->id : curr->id;
+    trace(THREAD_TRACE_SLEEP, curr->id, next ? next->id : THREAD_NONE);
+
+    runNext(w, curr, next);
+    return ret;
+}
+
+/**
+ * Function 5.39 Finds the wait queues of fd, registering it on first use
+ * The fd is added to the epoll set edge-triggered, and stays registered
+ * until thread_close. O_NONBLOCK is a flag of the open file description,
+ * which other processes may share, so it is set only where it has to be:
+ * sockets get MSG_DONTWAIT on each call instead, and are switched only to
+ * accept on. A tty, most likely shared with the shell, and an fd epoll
+ * refuses are left as they are and marked blocking.
+ * Runs inside a scheduler critical section.
+ * @param fd
+ * @param nonblock whether the call needs O_NONBLOCK even on a socket
+ * @return NULL with errno set on failure
+ */
+FdWait* ioLookup(int fd, bool nonblock) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    if (pollFd < 0 && (pollFd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return NULL;
+
+    if (fd >= fdCapacity) {
+        int cap = fdCapacity ? fdCapacity : 64;
+        while (cap <= fd)
+            cap *= 2;
+        FdWait **table = realloc(fdTable, cap * sizeof(*table));
+        if (!table) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        for (int i = fdCapacity; i < cap; i++)
+            table[i] = NULL;
+        fdTable = table;
+        fdCapacity = cap;
+    }
+    if (!fdTable[fd] && !(fdTable[fd] = calloc(1, sizeof(FdWait)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    FdWait *fw = fdTable[fd];
+    if (!fw->registered && !fw->blocking) {
+        if (isatty(fd)) {
+            fw->blocking = true;
+            return fw;
+        }
+
+        // Regular files are always ready, and epoll will not take them
+        struct epoll_event ev = {EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, {.fd = fd}};
+        if (epoll_ctl(pollFd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST) {
+            if (errno != EPERM)
+                return NULL;
+            fw->blocking = true;
+            return fw;
+        }
+
+        int type;
+        socklen_t len = sizeof(type);
+        fw->socket = !getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+        fw->registered = true;
+    }
+
+    if (fw->registered && !fw->nonblock && (!fw->socket || nonblock)) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0)
+            return NULL;
+        if (!(flags & O_NONBLOCK)) {
+            if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+                return NULL;
+            fw->restore = true;
+        }
+        fw->nonblock = true;
+    }
+    return fw;
+}
+
+/**
+ * Function 5.40 Makes every thread waiting in q ready on w
+ * @param w
+ * @param q
+ */
+void ioWake(Worker *w, threadQueue *q) {
+    ioWaiting -= q->size;
+    wokenAdd(w, q, GRANT_LOCK, NULL);
+}
+
+/**
+ * Function 5.41 Collects ready fds from epoll and wakes their waiters
+ * Called with the scheduler lock held; it is dropped while blocking.
+ * @param w
+ * @param usec longest wait, 0 to only check and -1 to wait for an event
+ */
+void ioPoll(Worker *w, long usec) {
+    struct epoll_event events[POLL_EVENTS];
+    struct timespec timeout = {usec / 1000000, usec % 1000000 * 1000};
+    bool unlock = usec && workerCount > 1;
+
+    w->ioSkips = 0;
+    if (unlock)
+        schedUnlock();
+    int n = epoll_pwait2(pollFd, events, POLL_EVENTS, usec < 0 ? NULL : &timeout, NULL);
+    // Kernels before 5.11 only take a timeout in milliseconds
+    if (n < 0 && errno == ENOSYS)
+        n = epoll_wait(pollFd, events, POLL_EVENTS, usec < 0 ? -1 : (int)((usec + 999) / 1000));
+    if (unlock)
+        schedLock(w);
+
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        FdWait *fw = fd < fdCapacity ? fdTable[fd] : NULL;
+        if (!fw)
+            continue;
+
+        fw->seq++;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            ioWake(w, &fw->readers);
+        if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            ioWake(w, &fw->writers);
+    }
+}
+
+/**
+ * Function 5.42 Prepares a non-blocking call on fd
+ * @param fd
+ * @param seq set to the readiness count to hand to ioWait after EAGAIN
+ * @param nonblock whether the call has no MSG_DONTWAIT flag to pass
+ * @return -1 with errno set when fd cannot be used, otherwise how to make
+ *         the call: IO_NONBLOCK as it is, IO_DONTWAIT with MSG_DONTWAIT,
+ *         or IO_BLOCKING when it cannot be polled and has to block
+ */
+int ioBegin(int fd, unsigned int *seq, bool nonblock) {
+    int enable = schedOff();
+    FdWait *fw = ioLookup(fd, nonblock);
+    int mode = -1;
+
+    if (fw) {
+        *seq = fw->seq;
+        mode = fw->blocking ? IO_BLOCKING : fw->nonblock ? IO_NONBLOCK : IO_DONTWAIT;
+    }
+    schedSet(enable);
+    return mode;
+}
+
+/**
+ * Function 5.43 Sleeps the running thread until fd may be ready, after a
+ * call on it failed with EAGAIN
+ * Returns right away if an event came in since ioBegin, so none is lost.
+ * @param fd
+ * @param writing
+ * @param seq
+ */
+void ioWait(int fd, bool writing, unsigned int seq) {
+    int enable = schedOff();
+    FdWait *fw = fdTable[fd];
+
+    if (fw->seq == seq) {
+        currentWorker()->current->ioWait = true;
+        // As for timers, a parked worker is to keep the poller going
+        if (!ioWaiting++)
+            workerWake(currentWorker());
+        sleepCurrent(writing ? &fw->writers : &fw->readers, 0);
+    }
+    schedSet(enable);
+}
+
+/**
+ * Function 5.44 Sleeps on wq until woken, unless the state word of an
+ * rwlock or semaphore has moved on from s
+ * Sets SYNC_WAITERS first. A release that sees the flag needs the
+ * scheduler to wake anyone, so it cannot slip in before we are queued.
+ * @param state
+ * @param s value seen by the caller, for which it must wait
+ * @param wq
+ * @return whether it slept; the waker has then handed it what it waited for
+ */
+bool syncSleep(unsigned int *state, unsigned int s, threadQueue *wq) {
+    int enable = schedOff();
+    bool slept = false;
+
+    if ((s & SYNC_WAITERS) || __atomic_compare_exchange_n(state, &s, s | SYNC_WAITERS,
+            false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (__atomic_load_n(state, __ATOMIC_RELAXED) == (s | SYNC_WAITERS))
+            slept = thread_sleep(wq) >= 0;
+    }
+    if (slept)
+        currentWorker()->current->grant = NULL;
+    schedSet(enable);
+    return slept;
+}
+
+/**
+ * Function 5.45 Appends a channel waiter to list
+ * @param list
+ * @param cw
+ */
+void chanEnqueue(WaiterList *list, ChanWaiter *cw) {
+    cw->next = NULL;
+    cw->prev = list->tail;
+    cw->list = list;
+    if (list->tail)
+        list->tail->next = cw;
+    else
+        list->head = cw;
+    list->tail = cw;
+}
+
+/**
+ * Function 5.46 Takes every case of a thread blocked in chan_select off
+ * its channel, in O(cases)
+ * @param node
+ */
+void chanUnwait(threadNode *node) {
+    for (int i = 0; node->chanWaiters && i < node->chanWaitCount; i++) {
+        ChanWaiter *cw = &node->chanWaiters[i];
+        WaiterList *list = cw->list;
+
+        if (cw->prev)
+            cw->prev->next = cw->next;
+        else
+            list->head = cw->next;
+        if (cw->next)
+            cw->next->prev = cw->prev;
+        else
+            list->tail = cw->prev;
+    }
+    node->chanWaiters = NULL;
+}
+
+/**
+ * Function 5.47 Completes case cw of a blocked thread and wakes it up
+ * Its other cases are withdrawn, so each item wakes exactly one thread.
+ * @param cw
+ * @param ok false when the channel was closed
+ */
+void chanComplete(ChanWaiter *cw, bool ok) {
+    threadNode *node = cw->thread;
+
+    // A pending future_send or future_recv settles its future instead
+    if (!node) {
+        futureChanDone(cw, ok);
+        return;
+    }
+
+    node->chanFired = cw->index;
+    node->chanOk = ok;
+    chanUnwait(node);
+    enqueueReady(currentWorker(), node);
+}
+
+/**
+ * Function 5.48 Sends item on ch without blocking
+ * A blocked receiver gets the item directly, otherwise it is buffered.
+ * @param ch
+ * @param item
+ * @return 0, THREAD_NONE when full, THREAD_INVALID when closed
+ */
+int chanTrySend(Chan *ch, void *item) {
+    if (ch->closed)
+        return THREAD_INVALID;
+
+    // Receivers only wait while the buffer is empty
+    ChanWaiter *cw = ch->receivers.head;
+    if (cw) {
+        cw->item = item;
+        chanComplete(cw, true);
+        return 0;
+    }
+    if (ch->count == ch->capacity)
+        return THREAD_NONE;
+
+    ch->buf[(ch->head + ch->count++) % ch->capacity] = item;
+    return 0;
+}
+
+/**
+ * Function 5.49 Receives from ch without blocking
+ * The slot freed is refilled from the first blocked sender, if any.
+ * @param ch
+ * @param item
+ * @return 0, THREAD_NONE when empty, THREAD_INVALID when closed and empty
+ */
+int chanTryRecv(Chan *ch, void **item) {
+    if (!ch->count)
+        return ch->closed ? THREAD_INVALID : THREAD_NONE;
+
+    *item = ch->buf[ch->head];
+    ch->head = (ch->head + 1) % ch->capacity;
+    ch->count--;
+
+    // Senders only wait while the buffer is full
+    ChanWaiter *cw = ch->senders.head;
+    if (cw) {
+        ch->buf[(ch->head + ch->count++) % ch->capacity] = cw->item;
+        chanComplete(cw, true);
+    }
+    return 0;
+}
+
+/**
+ * Function 5.50 Runs the first ready case of a select, or blocks on all
+ * of them until one completes
+ * Runs inside a scheduler critical section. Cases are polled from a
+ * rotating start so that no channel starves the others.
+ * @param cases
+ * @param count
+ * @param block
+ * @return index of the completed case, THREAD_NONE when none is ready and
+ *         block is 0, or when blocking would never end
+ */
+int chanSelect(struct chan_case *cases, int count, bool block) {
+    static unsigned int turn;
+    int start = turn++ % count;
+
+    for (int k = 0; k < count; k++) {
+        int i = (start + k) % count;
+        int ret = cases[i].send ? chanTrySend(cases[i].chan, cases[i].item)
+                                : chanTryRecv(cases[i].chan, &cases[i].item);
+        if (ret != THREAD_NONE) {
+            cases[i].ok = ret == 0;
+            if (!cases[i].ok && !cases[i].send)
+                cases[i].item = NULL;
+            return i;
+        }
+    }
+
+    // Nothing else could ever run to complete a case
+    if (!block || (runnableCount() <= 1 && !timerCount && !ioWaiting))
+        return THREAD_NONE;
+
+    threadNode *curr = currentWorker()->current;
+
+    // Killed while running on another worker
+    if (curr->state == EXIT)
+        thread_exit();
+
+    ChanWaiter waiters[count];
+    for (int i = 0; i < count; i++) {
+        waiters[i].thread = curr;
+        waiters[i].future = NULL;
+        waiters[i].index = i;
+        waiters[i].item = cases[i].item;
+        chanEnqueue(cases[i].send ? &cases[i].chan->senders : &cases[i].chan->receivers, &waiters[i]);
+    }
+    curr->chanWaiters = waiters;
+    curr->chanWaitCount = count;
+    curr->chanFired = -1;
+
+    if (sleepCurrent(NULL, 0) == THREAD_NONE) {
+        chanUnwait(curr);
+        return THREAD_NONE;
+    }
+
+    int i = curr->chanFired;
+    cases[i].ok = curr->chanOk;
+    if (!cases[i].send)
+        cases[i].item = curr->chanOk ? waiters[i].item : NULL;
+    return i;
+}
+
+/**
+ * Function 5.51 Starts or stops the interrupt layer's timer
+ * @param on
+ */
+void tickArm(bool on) {
+    interrupts_tick(on ? tickQuantum : 0);
+    tickArmed = on;
+}
+
+/**
+ * Function 5.52 Whether a tick has work to do
+ * That is while a thread waits to run and could preempt another, or while
+ * timed or I/O waits rely on the tick to be noticed.
+ * @return
+ */
+bool tickWanted() {
+    bool want = timerCount || ioWaiting;
+    for (int i = 0; !want && i < workerCount; i++)
+        want = workers[i].readyCount > 0;
+    return want && tickQuantum > 0;
+}
+
+/**
+ * Function 5.53 Starts the timer as soon as a tick has work to do
+ * Stopping it is left to tickTaken. Only starting it costs a system call.
+ */
+void tickUpdate() {
+    if (!tickActive || !tickWanted())
+        return;
+
+    tickBusy = true;
+    if (!tickArmed)
+        tickArm(true);
+}
+
+/**
+ * Function 5.54 Accounts for a tick that came through thread_preempt
+ * The first one shows the interrupt layer's timer is running. The timer
+ * is stopped at a tick ending a whole period nothing needed it for, so
+ * work that comes and goes within a period does not stop and restart it.
+ */
+void tickTaken() {
+    if (!interrupts_tick)
+        return;
+
+    if (!tickActive) {
+        tickActive = tickArmed = true;
+        // Only restarted for a period set before the first tick
+        if (tickQuantum != SIG_INTERVAL)
+            tickArm(tickQuantum > 0);
+    }
+
+    bool want = tickWanted();
+    if (tickArmed && !want && !tickBusy)
+        tickArm(false);
+    tickBusy = want;
+}
+
+/**
+ * Function 5.55 Makes every thread sleeping in q ready on w in O(1)
+ * The queue is spliced onto the woken queue of w as a whole; timers,
+ * states, grants and run queue levels are only dealt with once w gets to
+ * each thread, so a broadcast to many threads stays short. The batch
+ * records when it was woken up and what each thread is handed.
+ * @param w
+ * @param q
+ * @param kind
+ * @param grant the lock, rwlock or semaphore handed to every thread of q,
+ *              NULL for none
+ */
+void wokenAdd(Worker *w, threadQueue *q, GRANT_KIND kind, void *grant) {
+    if (!q->size)
+        return;
+    while (w->batchCount == WOKEN_BATCHES)
+        wokenDrain(w, 1);
+
+    WokenBatch *b = &w->batches[(w->batchHead + w->batchCount++) % WOKEN_BATCHES];
+    b->last = q->tail;
+    b->stamp = __builtin_ia32_rdtsc();
+    b->grant = grant;
+    b->grantKind = kind;
+
+    wokenCount += q->size;
+    queueLock(w);
+    w->readyCount += q->size;
+    spliceQueue(&w->woken, q);
+    queueUnlock(w);
+    workerWake(w);
+}
+
+/**
+ * Function 5.56 Finishes waking up to count threads of the woken queue of w
+ * and queues them at their levels
+ * @param w
+ * @param count
+ */
+void wokenDrain(Worker *w, int count) {
+    while (count-- > 0 && w->woken.head) {
+        threadNode *node = w->woken.head;
+        WokenBatch *b = &w->batches[w->batchHead];
+
+        // Still points at the queue it slept on
+        node->queue = &w->woken;
+        queueLock(w);
+        dequeue(&w->woken);
+        w->readyCount--;
+        queueUnlock(w);
+        wokenCount--;
+        if (node == b->last) {
+            w->batchHead = (w->batchHead + 1) % WOKEN_BATCHES;
+            w->batchCount--;
+        }
+
+        timerCancel(&node->timer);
+        node->ioWait = false;
+        if (b->grant)
+            grantTo(node, b->grantKind, b->grant);
+        // Ready, as far as its statistics go, since the batch was woken
+        setStateAt(node, READY, b->stamp);
+        enqueueReady(w, node);
+    }
+}
+
+/**
+ * Function 5.57 Moves woken threads to the run queues of w before it picks
+ * one. FIFO takes them one pick at a time, behind the threads already
+ * ready; the other policies need them all queued to find the best level.
+ * @param w
+ */
+void wokenReady(Worker *w) {
+    if (w->woken.size)
+        wokenDrain(w, schedPolicy == THREAD_SCHED_FIFO ? 1 : w->woken.size);
+}
+
+/**
+ * Function 5.58 Finishes waking up every woken thread, before anything
+ * looks up a sleeping thread by its state or queue
+ */
+void wokenFlush() {
+    for (int i = 0; wokenCount && i < workerCount; i++)
+        wokenDrain(&workers[i], workers[i].woken.size);
+}
+
+/**
+ * Function 5.59 Returns the running thread without entering the scheduler
+ * A preemption between the two loads may move the thread to another
+ * worker, which the second look at the worker catches; it cannot move
+ * back before the next tick.
+ * @return
+ */
+threadNode* currentThread() {
+    for (;;) {
+        Worker *w = currentWorker();
+        threadNode *self = w->current;
+        if (currentWorker() == w)
+            return self;
+    }
+}
+
+/**
+ * Function 5.60 Calls the destructors of the keys node has values for
+ * Runs on the exiting thread itself, before thread_exit enters the
+ * scheduler, so the destructors may use the library.
+ * @param node
+ */
+void keyDestroy(threadNode *node) {
+    for (int round = 0; round < KEY_DESTRUCTOR_ROUNDS; round++) {
+        bool called = false;
+
+        for (int key = 0; key < THREAD_KEYS_MAX; key++) {
+            void *value = node->specific[key];
+            void (*destructor)(void *) = keyDestructors[key];
+
+            if (!value || !destructor || !(keyMask & (1u << key)))
+                continue;
+            node->specific[key] = NULL;
+            destructor(value);
+            called = true;
+        }
+        if (!called)
+            break;
+    }
+}
+
+/*
+ * Build with -DTHREAD_DEFERRED_MASK to mask interrupts with a flag per
+ * kernel thread instead of the signal mask. A tick landing while the flag
+ * is set only marks itself pending and is taken when the outermost critical
+ * section is left, so entering and leaving one costs no system call.
+ */
+/**
+ * Function 5.61 Enters a critical section, same contract as interrupts_off()
+ * Under THREAD_DEFERRED_MASK each access to the flags is a single %fs
+ * relative instruction (see THREAD_LOCAL), so a thread moved to another
+ * worker by a tick between them still reads and writes the flags of the
+ * kernel thread it runs on.
+ * @return whether interrupts were on
+ */
+int maskOff() {
+#ifdef THREAD_DEFERRED_MASK
+    int enabled = !maskFlag;
+    maskFlag = 1;
+    __asm__ volatile("" ::: "memory");
+    return enabled;
+#else
+    return interrupts_off();
+#endif
+}
+
+/**
+ * Function 5.62 Leaves a critical section entered by maskOff
+ * With deferred masking, a tick that came in meanwhile preempts the caller
+ * here, as the timer handler would have.
+ * @param enabled
+ */
+void maskSet(int enabled) {
+#ifdef THREAD_DEFERRED_MASK
+    if (!enabled) {
+        maskFlag = 1;
+        return;
+    }
+    for (;;) {
+        // Switched to from inside the timer handler, which left the signal
+        // blocked on this kernel thread
+        if (maskBlocked) {
+            maskBlocked = false;
+            interrupts_on();
+        }
+        __asm__ volatile("" ::: "memory");
+        maskFlag = 0;
+        __asm__ volatile("" ::: "memory");
+        if (!maskPending)
+            return;
+        maskFlag = 1;
+        maskPending = 0;
+        tickFlag = 1;
+        thread_yield(THREAD_ANY);
+    }
+#else
+    interrupts_set(enabled);
+#endif
+}
+
+#ifdef THREAD_DEFERRED_MASK
+/**
+ * Function 5.63 Takes a tick under deferred masking
+ * Inside a critical section the tick is only recorded. Otherwise the
+ * critical section is entered here, so the tick yields as it would with
+ * the signal mask.
+ * @return id of the thread run in between, as thread_yield, or THREAD_NONE
+ *         when the tick was deferred
+ */
+Tid maskTick() {
+    // A worker that has not entered the scheduler yet has nothing to preempt
+    if (maskFlag || !localWorker) {
+        maskPending = 1;
+        return THREAD_NONE;
+    }
+    maskFlag = 1;
+    maskBlocked = true;
+    tickFlag = 1;
+    Tid ret = thread_yield(THREAD_ANY);
+
+    // Ticks that came in while this thread was switched out. The signal
+    // may have been unblocked meanwhile, so they are taken as maskSet
+    // takes them rather than through the interrupt layer's handler again.
+    while (maskPending) {
+        maskPending = 0;
+        maskBlocked = true;
+        tickFlag = 1;
+        thread_yield(THREAD_ANY);
+    }
+    // Returning from the handler restores the mask it interrupted
+    maskBlocked = false;
+    __asm__ volatile("" ::: "memory");
+    maskFlag = 0;
+    return ret;
+}
+#endif
+
+/**
+ * Function 5.64 Bucket of the threads waiting on addr
+ * @param addr
+ * @return
+ */
+threadQueue* waitBucket(const int *addr) {
+    unsigned long a = (unsigned long)addr >> 2;
+    return &waitBuckets[(a * 0x9E3779B97F4A7C15UL >> 32) & (THREAD_WAIT_BUCKETS - 1)];
+}
+
+/**
+ * Function 5.65 Queues a ready thread on w at the head of its level
+ * @param w
+ * @param node
+ */
+void enqueueReadyFront(Worker *w, threadNode *node) {
+    int level = schedOps[schedPolicy].level(node);
+
+    setState(node, READY);
+    queueLock(w);
+    node->worker = w;
+    node->queueEpoch = boostEpoch;
+    prependNode(&w->ready[level], node);
+    w->readyMask |= 1u << level;
+    w->readyCount++;
+    queueUnlock(w);
+    workerWake(w);
+}
+
+/**
+ * Function 5.66 Whether the running thread may hand the CPU to next, a
+ * sleeping thread it just gave a resource to
+ * Only from the outermost critical section, where the caller would run on
+ * right away, and never past a thread of a better level.
+ * @param w
+ * @param next
+ * @param enable state returned by the caller's schedOff
+ * @return
+ */
+bool handOffOk(Worker *w, threadNode *next, int enable) {
+    threadNode *curr = w->current;
+    int level = schedOps[schedPolicy].level(next);
+
+    if (!handOffOn || !(enable & 1) || !curr || curr->state != RUNNING ||
+        level > schedOps[schedPolicy].level(curr))
+        return false;
+
+    // Threads woken in a batch are ready too, if not queued at a level yet
+    wokenReady(w);
+    return level <= bestLevel(w);
+}
+
+/**
+ * Function 5.67 Wakes next and runs it in place of the running thread
+ * The running thread is queued at the head of its level, right behind
+ * next. The tick is periodic, so next runs out what is left of it.
+ * @param w
+ * @param next unlinked from the queue it slept on
+ */
+void handOff(Worker *w, threadNode *next) {
+    threadNode *curr = w->current;
+
+    timerCancel(&next->timer);
+    next->worker = w;
+    trace(THREAD_TRACE_WAKEUP, curr->id, next->id);
+    trace(THREAD_TRACE_YIELD, curr->id, next->id);
+
+    curr->voluntary++;
+    enqueueReadyFront(w, curr);
+    runNext(w, curr, next);
+}
+
+/* Section 6. Thread Library Functions */
+/*
+ * Function 6.0 Stub
+ * The First Thread Running Function
+ * */
+void thread_stub(void (*thread_main)(void *), void *arg)
+{
+	// Leave the critical section the switch into this thread was made in
+	switchEnd();
+	schedSet(workerCount > 1 ? 1 | SCHED_LOCKED : 1);
+	thread_main(arg);
+	thread_exit();
+}
+
+/*
+ * Function 6.1 Init
+ * Get First Running Thread
+ * */
+void thread_init(void)
+{
+	// Create the first thread
+    threadNode *curr = tcbAlloc();
+    assert(curr);
+    curr->id = allocTid();
+    assert(curr->id == 0);
+    curr->state = RUNNING;
+    curr->prev = NULL;
+    curr->next = NULL;
+    curr->queue = NULL;
+    curr->stackPtr = NULL;
+    curr->stackSize = 0;
+    snprintf(curr->name, THREAD_NAME_MAX, "main");
+    curr->detached = false;
+    curr->joinable = false;
+    curr->exited = false;
+    curr->priority = curr->level = THREAD_PRIO_DEFAULT;
+    curr->levelEpoch = curr->queueEpoch = boostEpoch;
+    curr->grant = NULL;
+    curr->switching = 0;
+    curr->stamp = __builtin_ia32_rdtsc();
+    curr->switches = curr->voluntary = curr->preempted = 0;
+    for (int i = 0; i <= SLEEP; i++)
+        curr->cycles[i] = 0;
+    curr->timer.slot = NULL;
+    curr->timer.thread = curr;
+    curr->timedOut = false;
+    curr->ioWait = false;
+    curr->waitAddr = NULL;
+    curr->chanWaiters = NULL;
+    memset(curr->specific, 0, sizeof(curr->specific));
+    curr->joinQueue = (threadQueue){0, NULL, NULL};
+    curr->joiners = 0;
+    curr->joining = NULL;
+    curr->retval = NULL;
+    tcbTable[0] = curr;
+#ifndef THREAD_FAST_SWITCH
+    getcontext(curr->context);
+#endif
+
+	// Initialize the queue sizes
+    exitQueue.size = 0;
+
+	// The first thread runs on the first worker
+	localWorker = &workers[0];
+	curr->worker = &workers[0];
+	workers[0].current = curr;
+}
+
+/*
+ * Function 6.2 Get Thread ID
+ * */
+Tid thread_id()
+{
+	return currentThread()->id;
+}
+
+/*
+ * Function 6.3 Create
+ * None->Ready
+ * */
+Tid thread_create(void (*fn) (void *), void *parg)
+{
+	return thread_create_ex(fn, parg, NULL);
+}
+
+/*
+ * Function 6.3.1 Default Attributes
+ * */
+void thread_attr_init(struct thread_attr *attr)
+{
+	attr->stack_size = THREAD_MIN_STACK;
+	attr->name = NULL;
+	attr->priority = THREAD_PRIO_DEFAULT;
+	attr->detached = 0;
+	attr->joinable = 0;
+}
+
+/*
+ * Function 6.3.2 Create with Attributes
+ * None->Ready
+ * */
+Tid thread_create_ex(void (*fn) (void *), void *parg, const struct thread_attr *attr)
+{
+	struct thread_attr defaults;
+	if (!attr) {
+		thread_attr_init(&defaults);
+		attr = &defaults;
+	}
+
+	// Corner Case 1. Bad attributes
+	if (attr->priority < 0 || attr->priority >= THREAD_PRIO_LEVELS)
+		return THREAD_INVALID;
+	long stackSize = attr->stack_size ? (long)attr->stack_size : THREAD_MIN_STACK;
+	if (stackSize < THREAD_STACK_FLOOR)
+		stackSize = THREAD_STACK_FLOOR;
+
+	int enabled = schedOff();
+
+	// Reclaim exited threads first, so their stacks can be reused
+	reapExited();
+
+	// Find an available thread id
+	Tid id = allocTid();
+	if (id < 0) {
+		schedSet(enabled);
+		return id;
+	}
+
+    // Step 1. Create new threads at tail
+    threadNode *curr = tcbAlloc();
+	if (curr == NULL) {
+		freeTid(id);
+		schedSet(enabled);
+		return THREAD_NOMEMORY;
+	}
+
+    // Step 2. Assign Members
+	curr->id = id;
+	curr->stackSize = stackSize;
+	curr->stackPtr = stackAlloc(stackSize);
+
+	// Corner Case 2. No memory available for thread stackPtr
+    if (curr->stackPtr == NULL) {
+        freeTid(id);
+        tcbFree(curr);
+        schedSet(enabled);
+        return THREAD_NOMEMORY;
+    }
+
+	if (attr->name)
+		snprintf(curr->name, THREAD_NAME_MAX, "%s", attr->name);
+	else
+		snprintf(curr->name, THREAD_NAME_MAX, "tid-%d", id);
+	curr->detached = attr->detached;
+	curr->joinable = attr->joinable && !attr->detached;
+	curr->exited = false;
+	curr->priority = curr->level = attr->priority;
+	curr->levelEpoch = curr->queueEpoch = boostEpoch;
+	curr->grant = NULL;
+	curr->switching = 0;
+	curr->state = EXIT;
+	curr->stamp = __builtin_ia32_rdtsc();
+	curr->switches = curr->voluntary = curr->preempted = 0;
+	for (int i = 0; i <= SLEEP; i++)
+		curr->cycles[i] = 0;
+	curr->timer.slot = NULL;
+	curr->timer.thread = curr;
+	curr->timedOut = false;
+	curr->ioWait = false;
+	curr->waitAddr = NULL;
+	curr->chanWaiters = NULL;
+	memset(curr->specific, 0, sizeof(curr->specific));
+	curr->joinQueue = (threadQueue){0, NULL, NULL};
+	curr->joiners = 0;
+	curr->joining = NULL;
+	curr->retval = NULL;
+	initContext(curr, thread_stub, fn, parg);
+
+	// Add newly created thread to the end of this worker's ready queue
+	enqueueReady(currentWorker(), curr);
+
+	// Thread id of newly created thread is now taken
+	tcbTable[id] = curr;
+	trace(THREAD_TRACE_CREATE, thread_id(), id);
+
+	schedSet(enabled);
+	return id;
+}
+
+/*
+ * Function 6.4 Start Workers
+ * Runs green threads on count kernel threads from now on
+ * */
+Tid thread_start_workers(int count)
+{
+	int enabled = schedOff();
+	Worker *w = currentWorker();
+
+	// Corner Case: Bad count, already started, or other threads exist
+	bool alone = !w->readyCount;
+	for (int i = 0; alone && i < tidCapacity; i++)
+		alone = !tcbTable[i] || tcbTable[i] == w->current;
+	if (count < 1 || count > THREAD_MAX_WORKERS || workerCount > 1 || !alone) {
+		schedSet(enabled);
+		return THREAD_INVALID;
+	}
+	if (count == 1) {
+		schedSet(enabled);
+		return count;
+	}
+
+#ifndef THREAD_FAST_SWITCH
+	// Blocks the idle contexts of all workers are saved in
+	for (int i = 0; i < count; i++) {
+		if (!workers[i].idle.context && !(workers[i].idle.context = slabAlloc(&contextSlab))) {
+			schedSet(enabled);
+			return THREAD_NOMEMORY;
+		}
+	}
+#endif
+
+	// Idle context of this kernel thread
+	w->idle.stackSize = THREAD_MIN_STACK;
+	w->idle.stackPtr = stackAlloc(w->idle.stackSize);
+	if (!w->idle.stackPtr) {
+		schedSet(enabled);
+		return THREAD_NOMEMORY;
+	}
+	initContext(&w->idle, workerStub, NULL, w);
+
+	// Take the lock before other workers can see workerCount > 1
+	schedLock(w);
+	w->kthread = pthread_self();
+	workerCount = count;
+	for (int i = 1; i < count; i++) {
+		if (pthread_create(&workers[i].kthread, NULL, workerMain, &workers[i])) {
+			workerCount = i;
+			break;
+		}
+	}
+	count = workerCount;
+
+	if (count == 1)
+		schedUnlock();
+	else
+		enabled |= SCHED_LOCKED;
+	schedSet(enabled);
+	return count;
+}
+
+/*
+ * Function 6.5 Yield
+ * Running->Ready & Ready->Running
+ * */
+Tid thread_yield(Tid want_tid) {
+    int enable = schedOff();
+    Worker *w = currentWorker();
+
+    // Wake up threads whose timed sleep ran out
+    if (timerCount)
+        timerAdvance();
+
+    threadNode *wantThread, *currentThread = w->current;
+
+    bool preempted = want_tid == THREAD_ANY && tickFlag;
+    tickFlag = 0;
+    if (preempted)
+        tickTaken();
+
+    // Check for I/O on the timer tick, or when nothing else is ready
+    if (ioWaiting && (preempted || !w->readyCount))
+        ioPoll(w, 0);
+
+    // Killed while running on another worker
+    if (currentThread->state == EXIT)
+        thread_exit();
+
+    // Case 1. Want Current Running Thread
+    // Let running thread continue running
+    if (want_tid == THREAD_SELF || want_tid == currentThread->id) {
+        schedSet(enable);
+        return currentThread->id;
+    }
+
+    if (want_tid == THREAD_ANY) {
+        // Case 2. Want Any Ready Thread
+        schedOps[schedPolicy].account(currentThread, preempted);
+
+        // Take the best ready thread, stealing one when this worker has none,
+        // unless it would run below the current thread's level
+        if (!w->readyCount)
+            stealInto(w);
+        wokenReady(w);
+        if (bestLevel(w) > schedOps[schedPolicy].level(currentThread)) {
+            schedSet(enable);
+            return THREAD_NONE;
+        }
+        // Stolen meanwhile by a parked worker, which runs it instead
+        if (!(wantThread = pickNext(w))) {
+            schedSet(enable);
+            return THREAD_NONE;
+        }
+    } else {
+        // Case 3. Want Specific Ready Thread
+        // Get the want ID thread from the TCB table and let it run
+        wantThread = lookupThread(want_tid);
+        if (wantThread && wantThread->state == SLEEP && wokenCount)
+            wokenFlush();
+
+        if (!wantThread || wantThread->state != READY) {
+            schedSet(enable);
+            return THREAD_INVALID;
+        }
+
+        // Take it from whichever worker holds it
+        removeReady(wantThread);
+    }
+    want_tid = wantThread->id;
+    if (preempted)
+        currentThread->preempted++;
+    else
+        currentThread->voluntary++;
+
+    trace(preempted ? THREAD_TRACE_PREEMPT : THREAD_TRACE_YIELD, currentThread->id, want_tid);
+
+    // Move current thread to end of its ready queue and run the wanted one
+    enqueueReady(w, currentThread);
+    runNext(w, currentThread, wantThread);
+
+	schedSet(enable);
+	return want_tid;
+}
+
+/*
+ * Function 6.5.1 Preempt
+ * Called by the interrupt layer's timer handler in place of a yield
+ * */
+Tid thread_preempt()
+{
+	tickForward();
+	if (!tickQuantum)
+		return THREAD_NONE;
+
+#ifdef THREAD_DEFERRED_MASK
+	return maskTick();
+#else
+	tickFlag = 1;
+	Tid ret = thread_yield(THREAD_ANY);
+	tickFlag = 0;
+	return ret;
+#endif
+}
+
+/*
+ * Function 6.6 Exit
+ * Running->Exit
+ * */
+void thread_exit()
+{
+    keyDestroy(currentThread());
+
+    int enable = schedOff();
+    Worker *w = currentWorker();
+
+	// Release the id and wake up threads waiting on this thread's exit
+    threadNode* exitThread = w->current;
+	retireThread(exitThread);
+
+	// Free earlier exits in batches, while on a stack that stays valid
+	if (exitQueue.size >= THREAD_REAP_BATCH)
+		reapExited();
+
+	// Pick the next thread to run on this worker
+	threadNode *next = pickNextWait(w);
+	w->current = NULL;
+	trace(THREAD_TRACE_EXIT, exitThread->id, next ? next->id : THREAD_NONE);
+
+	if (!next && !runnableCount() && !timerCount && !ioWaiting) {
+		// This is the last running thread.
+        freeQueue(&exitQueue);
+
+		// Deallocate memory for this thread, but not the stack we are still
+		// running on; it goes away with the process
+		tcbFree(exitThread);
+
+		// Keep interrupts off: a tick here would find no running thread
+		exit(0);
+	}
+
+	// Append exited thread to exit queue, run the next thread or go idle
+    enqueueNode(&exitQueue, exitThread);
+    w->current = next;
+    tickUpdate();
+    if (next) {
+        setState(next, RUNNING);
+        next->switches++;
+    } else {
+        next = &w->idle;
+    }
+    // The exit queue is only reaped once the switch is through
+    switchBegin(w, exitThread, next);
+    jumpThread(exitThread, next);
+    schedSet(enable);
+}
+
+/*
+ * Function 6.6.1 Exit with Value
+ * ret is handed to the threads joining this one
+ * */
+void thread_exit_value(void *ret)
+{
+    currentThread()->retval = ret;
+    thread_exit();
+}
+
+/*
+ * Function 6.7 Kill
+ * Ready->Exit
+ * */
+Tid thread_kill(Tid tid)
+{
+	int enable = schedOff();
+
+    threadNode *target = lookupThread(tid);
+    if (target && target->state == SLEEP && wokenCount)
+        wokenFlush();
+
+    // Corner Case: Invalid ID
+	if (!target || tid == thread_id() || target->state == EXIT){
+		schedSet(enable);
+		return THREAD_INVALID;
+	}
+
+    trace(THREAD_TRACE_KILL, thread_id(), tid);
+
+    // Running on another worker: it exits at its next yield or sleep
+    if (target->state == RUNNING) {
+        setState(target, EXIT);
+        schedSet(enable);
+        return tid;
+    }
+
+    // Common Case: Unlink Wanted Thread from its queue and Insert to Exit Queue
+    if (target->state == READY) {
+        removeReady(target);
+    } else {
+        unlinkNode(target);
+        timerCancel(&target->timer);
+        if (target->ioWait)
+            ioWaiting--;
+        chanUnwait(target);
+    }
+    retireThread(target);
+    enqueueNode(&exitQueue, target);
+	schedSet(enable);
+	return tid;
+}
+
+/*
+ * Function 6.8 Set Max Threads
+ * Ids already handed out above the new limit stay valid until they exit
+ * */
+int thread_set_max_threads(int max)
+{
+	if (max < 1)
+		return THREAD_INVALID;
+
+	int enable = schedOff();
+	int old = maxThreads;
+	maxThreads = max;
+	schedSet(enable);
+	return old;
+}
+
+/*
+ * Function 6.9 Set Policy
+ * Ready threads are requeued under the new policy
+ * */
+int thread_set_policy(int policy)
+{
+	if (policy < THREAD_SCHED_FIFO || policy > THREAD_SCHED_MLFQ)
+		return THREAD_INVALID;
+
+	int enable = schedOff();
+	int old = schedPolicy;
+
+	schedPolicy = policy;
+	for (int i = 0; i < tidCapacity; i++)
+		if (tcbTable[i])
+			tcbTable[i]->level = tcbTable[i]->priority;
+	requeueReady();
+
+	schedSet(enable);
+	return old;
+}
+
+/*
+ * Function 6.9.1 Set Hand-off
+ * */
+int thread_set_handoff(int on)
+{
+	int enable = schedOff();
+	int old = handOffOn;
+
+	handOffOn = on != 0;
+
+	schedSet(enable);
+	return old;
+}
+
+/*
+ * Function 6.10 Set Priority
+ * 0 is the highest priority, THREAD_PRIO_LEVELS - 1 the lowest
+ * */
+int thread_set_priority(Tid tid, int priority)
+{
+	if (priority < 0 || priority >= THREAD_PRIO_LEVELS)
+		return THREAD_INVALID;
+
+	int enable = schedOff();
+	threadNode *target = lookupThread(tid == THREAD_SELF ? thread_id() : tid);
+
+	if (!target || target->state == EXIT) {
+		schedSet(enable);
+		return THREAD_INVALID;
+	}
+
+	int old = target->priority;
+	target->priority = target->level = priority;
+
+	// Move a ready thread to its new level
+	if (target->state == READY) {
+		Worker *w = target->worker;
+		removeReady(target);
+		enqueueReady(w, target);
+	}
+
+	schedSet(enable);
+	return old;
+}
+
+/*
+ * Function 6.11 Statistics
+ * Snapshot of up to max live threads, times include the current interval
+ * */
+int thread_stats(struct thread_stats *buf, int max)
+{
+	int enable = schedOff();
+	unsigned long now = __builtin_ia32_rdtsc();
+	int count = 0;
+
+	// Threads woken in a batch are ready, not sleeping
+	wokenFlush();
+	for (int i = 0; i < tidCapacity && count < max; i++) {
+		threadNode *node = tcbTable[i];
+		if (!node || node->exited)
+			continue;
+
+		struct thread_stats *st = &buf[count++];
+		st->id = node->id;
+		snprintf(st->name, THREAD_NAME_MAX, "%s", node->name);
+		st->state = node->state;
+		st->priority = node->priority;
+		st->switches = node->switches;
+		st->voluntary = node->voluntary;
+		st->preempted = node->preempted;
+		st->run_cycles = node->cycles[RUNNING];
+		st->ready_cycles = node->cycles[READY];
+		st->sleep_cycles = node->cycles[SLEEP];
+		if (node->state == RUNNING)
+			st->run_cycles += now - node->stamp;
+		else if (node->state == READY)
+			st->ready_cycles += now - node->stamp;
+		else if (node->state == SLEEP)
+			st->sleep_cycles += now - node->stamp;
+	}
+
+	schedSet(enable);
+	return count;
+}
+
+/*
+ * Function 6.12 Statistics Dump
+ * One line per live thread
+ * */
+void thread_stats_dump(FILE *out)
+{
+	static const char *names[] = {"exit", "ready", "running", "sleep"};
+	int enable = schedOff();
+	int max = tidCapacity;
+	struct thread_stats *buf = malloc(max * sizeof(*buf));
+	assert(buf);
+	int count = thread_stats(buf, max);
+	schedSet(enable);
+
+	fprintf(out, "%6s %-16s %-8s %4s %10s %10s %10s %14s %14s %14s\n", "tid",
+	        "name", "state", "prio", "switches", "voluntary", "preempted",
+	        "run_cycles", "ready_cycles", "sleep_cycles");
+	for (int i = 0; i < count; i++) {
+		struct thread_stats *st = &buf[i];
+		fprintf(out, "%6d %-16s %-8s %4d %10lu %10lu %10lu %14lu %14lu %14lu\n",
+		        st->id, st->name, names[st->state], st->priority, st->switches,
+		        st->voluntary, st->preempted, st->run_cycles,
+		        st->ready_cycles, st->sleep_cycles);
+	}
+
+	enable = schedOff();
+	free(buf);
+	schedSet(enable);
+}
+
+/*
+ * Function 6.13 Read
+ * Blocks only the calling thread until fd has data
+ * */
+ssize_t thread_read(int fd, void *buf, size_t count)
+{
+	// Interrupts stay off around the call, so errno is read on the worker
+	// the call ran on
+	int enabled = maskOff();
+	unsigned int seq;
+	ssize_t ret;
+
+	while ((ret = ioBegin(fd, &seq, false)) >= 0) {
+		int mode = ret;
+		// recv waits for data even to read nothing, read does not
+		if (mode == IO_DONTWAIT && count)
+			ret = recv(fd, buf, count, MSG_DONTWAIT);
+		else
+			ret = read(fd, buf, count);
+		if (ret >= 0 || errno != EAGAIN || mode == IO_BLOCKING)
+			break;
+		ioWait(fd, false, seq);
+	}
+
+	maskSet(enabled);
+	return ret;
+}
+
+/*
+ * Function 6.14 Write
+ * Blocks only the calling thread until fd has room, may write less than count
+ * */
+ssize_t thread_write(int fd, const void *buf, size_t count)
+{
+	// Interrupts stay off around the call, so errno is read on the worker
+	// the call ran on
+	int enabled = maskOff();
+	unsigned int seq;
+	ssize_t ret;
+
+	while ((ret = ioBegin(fd, &seq, false)) >= 0) {
+		int mode = ret;
+		if (mode == IO_DONTWAIT)
+			ret = send(fd, buf, count, MSG_DONTWAIT);
+		else
+			ret = write(fd, buf, count);
+		if (ret >= 0 || errno != EAGAIN || mode == IO_BLOCKING)
+			break;
+		ioWait(fd, true, seq);
+	}
+
+	maskSet(enabled);
+	return ret;
+}
+
+/*
+ * Function 6.15 Accept
+ * Blocks only the calling thread until a connection comes in on fd
+ * */
+int thread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	// Interrupts stay off around the call, so errno is read on the worker
+	// the call ran on
+	int enabled = maskOff();
+	unsigned int seq;
+	int ret;
+
+	while ((ret = ioBegin(fd, &seq, true)) >= 0) {
+		int mode = ret;
+		ret = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (ret >= 0 || errno != EAGAIN || mode == IO_BLOCKING)
+			break;
+		ioWait(fd, false, seq);
+	}
+
+	maskSet(enabled);
+	return ret;
+}
+
+/*
+ * Function 6.16 Close
+ * Removes fd from the poller, waking any thread still waiting on it
+ * */
+int thread_close(int fd)
+{
+	int enable = schedOff();
+	Worker *w = currentWorker();
+
+	if (fd >= 0 && fd < fdCapacity && fdTable[fd]) {
+		FdWait *fw = fdTable[fd];
+		if (fw->registered)
+			epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, NULL);
+
+		// Hand the open file description back as we found it, for
+		// whoever else holds it
+		int flags;
+		if (fw->restore && (flags = fcntl(fd, F_GETFL)) >= 0)
+			fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+		// Waiters retry their call and fail with EBADF
+		fw->seq++;
+		ioWake(w, &fw->readers);
+		ioWake(w, &fw->writers);
+		fw->registered = false;
+		fw->blocking = false;
+		fw->socket = false;
+		fw->nonblock = false;
+		fw->restore = false;
+	}
+
+	schedSet(enable);
+	return close(fd);
+}
+
+/*
+ * Function 6.17 Set Quantum
+ * Period of the preemption timer in microseconds, 0 turns preemption off
+ * */
+long thread_set_quantum(long usec)
+{
+	if (usec < 0)
+		return THREAD_INVALID;
+
+	int enable = schedOff();
+	long old = tickQuantum;
+
+	tickQuantum = usec;
+
+	// Restart a running timer only when its period changes
+	if (tickArmed && usec != old)
+		tickArm(usec > 0);
+	tickUpdate();
+
+	schedSet(enable);
+	return old;
+}
+
+/*
+ * Function 6.18 Create Key
+ * The slot starts out NULL in every thread
+ * */
+int thread_key_create(void (*destructor)(void *))
+{
+	int enable = schedOff();
+
+	// Corner Case: All keys taken
+	if (keyMask == (THREAD_KEYS_MAX == 32 ? ~0u : (1u << THREAD_KEYS_MAX) - 1)) {
+		schedSet(enable);
+		return THREAD_NOMORE;
+	}
+
+	int key = __builtin_ctz(~keyMask);
+	keyMask |= 1u << key;
+	keyDestructors[key] = destructor;
+
+	schedSet(enable);
+	return key;
+}
+
+/*
+ * Function 6.19 Delete Key
+ * Destructors are not called for values still set. The slot is cleared
+ * in every thread, so a key created later with the same number starts
+ * out NULL.
+ * */
+int thread_key_delete(int key)
+{
+	int enable = schedOff();
+
+	if (key < 0 || key >= THREAD_KEYS_MAX || !(keyMask & (1u << key))) {
+		schedSet(enable);
+		return THREAD_INVALID;
+	}
+	keyMask &= ~(1u << key);
+	keyDestructors[key] = NULL;
+	for (int i = 0; i < tidCapacity; i++)
+		if (tcbTable[i])
+			tcbTable[i]->specific[key] = NULL;
+
+	schedSet(enable);
+	return 0;
+}
+
+/*
+ * Function 6.20 Get Specific
+ * Only reads the running thread's own slot, no critical section needed
+ * */
+void *thread_getspecific(int key)
+{
+	if ((unsigned)key >= THREAD_KEYS_MAX || !(keyMask & (1u << key)))
+		return NULL;
+	return currentThread()->specific[key];
+}
+
+/*
+ * Function 6.21 Set Specific
+ * */
+int thread_setspecific(int key, void *value)
+{
+	if ((unsigned)key >= THREAD_KEYS_MAX || !(keyMask & (1u << key)))
+		return THREAD_INVALID;
+	currentThread()->specific[key] = value;
+	return 0;
+}
+
+/*
+ * Function 6.22 Start Trace
+ * Clears the ring and records from now on
+ * */
+void thread_trace_start()
+{
+	int enable = schedOff();
+
+	traceHead = 0;
+	clock_gettime(CLOCK_MONOTONIC, &traceStartTime);
+	traceStartTsc = __builtin_ia32_rdtsc();
+	traceOn = true;
+
+	schedSet(enable);
+}
+
+/*
+ * Function 6.23 Stop Trace
+ * The ring keeps its events for thread_trace_dump
+ * */
+void thread_trace_stop()
+{
+	int enable = schedOff();
+	traceOn = false;
+	schedSet(enable);
+}
+
+/*
+ * Function 6.24 Dump Trace
+ * Header, then the events in the ring, oldest first
+ * */
+int thread_trace_dump(FILE *out)
+{
+	struct thread_trace_header hdr = {THREAD_TRACE_MAGIC, THREAD_TRACE_VERSION, 0, 0};
+	struct timespec now;
+
+	int enable = schedOff();
+	unsigned long head = traceHead;
+	unsigned long count = head < THREAD_TRACE_EVENTS ? head : THREAD_TRACE_EVENTS;
+	struct thread_trace_event *buf = malloc((count ? count : 1) * sizeof(*buf));
+	if (!buf) {
+		schedSet(enable);
+		return THREAD_NOMEMORY;
+	}
+	for (unsigned long i = 0; i < count; i++)
+		buf[i] = traceRing[(head - count + i) & (THREAD_TRACE_EVENTS - 1)];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - traceStartTime.tv_sec) * 1e9 + (now.tv_nsec - traceStartTime.tv_nsec);
+	unsigned long cycles = __builtin_ia32_rdtsc() - traceStartTsc;
+	schedSet(enable);
+
+	hdr.count = count;
+	hdr.cycles_per_us = ns > 0 ? cycles / ns * 1000 : 0;
+	int ret = fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+	          fwrite(buf, sizeof(*buf), count, out) == count ? (int)count : THREAD_FAILED;
+
+	enable = schedOff();
+	free(buf);
+	schedSet(enable);
+	return ret;
+}
+
+/*******************************************************************
+ * Important: The rest of the code should be implemented in Lab 3. *
+ *******************************************************************/
+/* make sure to fill the wait_queue structure defined above */
+struct wait_queue * wait_queue_create()
+{
+	struct wait_queue *wq;
+
+	int enabled = schedOff();
+	wq = slabAlloc(&queueSlab);
+	schedSet(enabled);
+	assert(wq);
+
+	wq->size = 0;
+	wq->head = NULL;
+	wq->tail = NULL;
+
+	return wq;
+}
+
+void wait_queue_destroy(struct wait_queue *wq)
+{
+	int enabled = schedOff();
+    freeQueue(wq);
+	slabFree(&queueSlab, wq);
+	schedSet(enabled);
+}
+
+Tid thread_sleep(struct wait_queue *queue)
+{
+	int enabled = schedOff();
+
+	// Corner Case 1. Invalid Queue
+	if (!queue) {
+		schedSet(enabled);
+		return THREAD_INVALID;
+	}
+    Worker *w = currentWorker();
+
+    // Killed while running on another worker
+    if (w->current->state == EXIT)
+        thread_exit();
+
+    // Corner Case 2. No other ready or running Thread, and no timer or I/O
+    // that could wake one up
+	if (runnableCount() <= 1 && !timerCount && !ioWaiting) {
+		schedSet(enabled);
+		return THREAD_NONE;
+	}
+
+	int ret = sleepCurrent(queue, 0);
+
+	schedSet(enabled);
+	return ret;
+}
+
+/* like thread_sleep, but gives up after usec microseconds. returns 1 when
+ * woken up, 0 on timeout. */
+int thread_sleep_timeout(struct wait_queue *queue, long usec)
+{
+	int enabled = schedOff();
+
+	// Corner Case 1. Invalid Queue or timeout
+	if (!queue || usec < 0) {
+		schedSet(enabled);
+		return THREAD_INVALID;
+	}
+
+    // Corner Case 2. Nothing to wait for
+	if (!usec) {
+		schedSet(enabled);
+		return 0;
+	}
+
+	// The sleep was taken back, nothing could ever wake us up
+	if (sleepCurrent(queue, timerDeadline(usec)) == THREAD_NONE) {
+		schedSet(enabled);
+		return THREAD_NONE;
+	}
+	int woken = !currentWorker()->current->timedOut;
+
+	schedSet(enabled);
+	return woken;
+}
+
+/* suspend current thread for at least usec microseconds */
+int thread_sleep_for(long usec)
+{
+	int enabled = schedOff();
+
+	if (usec < 0) {
+		schedSet(enabled);
+		return THREAD_INVALID;
+	}
+
+	if (usec)
+		sleepCurrent(NULL, timerDeadline(usec));
+
+	schedSet(enabled);
+	return 0;
+}
+
+/* when the 'all' parameter is 1, wakeup all threads waiting in the queue.
+ * returns whether a thread was woken up on not. */
+int thread_wakeup(threadQueue *queue, int all)
+{
+	int enabled = schedOff();
+
+    // Corner Case: Invalid or empty queue
+	if (!queue || !queue->size) {
+		schedSet(enabled);
+		return 0;
+	}
+
+	int count = 0;
+	// Case 1. wake up one
+	if(!all){
+        threadNode *node = dequeue(queue);
+        trace(THREAD_TRACE_WAKEUP, thread_id(), node->id);
+        timerCancel(&node->timer);
+        enqueueReady(currentWorker(), node);
+		count++;
+	}else{
+	    // Case 2. Wake up all, in one splice
+        count = queue->size;
+        trace(THREAD_TRACE_WAKEUP_ALL, thread_id(), count);
+        wokenAdd(currentWorker(), queue, GRANT_LOCK, NULL);
+	}
+
+	schedSet(enabled);
+	return count;
+}
+
+/* sleep while *addr still holds expected, on the bucket of addr. returns 0
+ * when woken up, 1 when *addr held another value, THREAD_NONE when nothing
+ * could wake us. */
+int thread_wait_on(const int *addr, int expected)
+{
+	int enabled = schedOff();
+
+	// Corner Case 1. The value already changed
+	if (!addr || __atomic_load_n(addr, __ATOMIC_ACQUIRE) != expected) {
+		schedSet(enabled);
+		return addr ? 1 : THREAD_INVALID;
+	}
+
+    // Corner Case 2. No other thread could ever change it
+	if (runnableCount() <= 1 && !timerCount && !ioWaiting) {
+		schedSet(enabled);
+		return THREAD_NONE;
+	}
+
+	threadNode *curr = currentWorker()->current;
+	curr->waitAddr = addr;
+	int ret = sleepCurrent(waitBucket(addr), 0);
+	if (ret == THREAD_NONE)
+		curr->waitAddr = NULL;
+
+	schedSet(enabled);
+	return ret == THREAD_NONE ? THREAD_NONE : 0;
+}
+
+/* wake up to count threads sleeping on addr, skipping those of other
+ * addresses sharing its bucket. returns the number woken up. */
+int thread_wake_addr(const int *addr, int count)
+{
+	int enabled = schedOff();
+	threadQueue *bucket = waitBucket(addr);
+	threadNode *node = bucket->head;
+	int woken = 0;
+
+	while (node && woken < count) {
+		threadNode *next = node->next;
+		if (node->waitAddr == addr) {
+			unlinkNode(node);
+			node->waitAddr = NULL;
+			trace(THREAD_TRACE_WAKEUP, thread_id(), node->id);
+			enqueueReady(currentWorker(), node);
+			woken++;
+		}
+		node = next;
+	}
+
+	schedSet(enabled);
+	return woken;
+}
+
+/* suspend current thread until Thread tid exits */
+Tid thread_wait(Tid tid)
+{
+	return thread_join(tid, NULL);
+}
+
+/* like thread_wait, and stores the value tid exited with in ret unless ret
+ * is NULL. returns THREAD_NONE if tid could never exit. */
+Tid thread_join(Tid tid, void **ret)
+{
+	int enabled = schedOff();
+	threadNode *target = lookupThread(tid);
+
+    // Corner Cases
+	if (!target || tid == thread_id() || target->detached) {
+		schedSet(enabled);
+		return THREAD_INVALID;
+	}
+
+	// Case 1. Still running: sleep until it exits. Its TCB is held until
+	// every joiner has read the exit value
+	if (!target->exited) {
+		threadNode *curr = currentWorker()->current;
+		target->joiners++;
+		curr->joining = target;
+		Tid slept = thread_sleep(&target->joinQueue);
+		curr->joining = NULL;
+		target->joiners--;
+
+		if (slept == THREAD_NONE) {
+			schedSet(enabled);
+			return THREAD_NONE;
+		}
+	}
+
+	// Case 2. Exited: take its exit value, and its id if it was joinable
+	if (ret)
+		*ret = target->retval;
+	collectExited(target);
+	releaseExited(target);
+
+	schedSet(enabled);
+	return tid;
+}
+
+/* lets tid be freed as soon as it exits, or right away if it is an exited
+ * joinable thread. it can no longer be waited for; fails while a thread is
+ * waiting for it. */
+Tid thread_detach(Tid tid)
+{
+	int enabled = schedOff();
+	threadNode *target = lookupThread(tid == THREAD_SELF ? thread_id() : tid);
+
+	if (!target || target->detached || target->joiners) {
+		schedSet(enabled);
+		return THREAD_INVALID;
+	}
+	target->detached = true;
+	collectExited(target);
+
+	schedSet(enabled);
+	return target->id;
+}
+
+void taskPush(Task *task);
+Task *taskListPop(TaskList *list);
+
+#ifdef THREAD_LOCK_PROFILE
+/* contention totals of the locks created at one site. sites are never
+ * freed, so the totals outlive the locks. times are in TSC cycles. */
+typedef struct lockSite {
+	char name[48];
+	const char *label;
+	void *caller;
+	struct lock_stats stats;
+	struct lockSite *next;
+}LockSite;
+
+LockSite *lockSites = NULL;
+int lockSiteCount = 0;
+#endif
+
+typedef struct lock {
+	bool isLocked;
+	Tid thread;
+	threadQueue *wq;
+	TaskList tasks;			/* task_lock tasks waiting for it */
+#ifdef THREAD_LOCK_PROFILE
+	LockSite *site;
+	unsigned long acquiredAt;
+#endif
+}Lock;
+
+#ifdef THREAD_LOCK_PROFILE
+/* finds or adds the site of label, or of caller when label is NULL */
+LockSite *lockSiteFind(const char *label, void *caller)
+{
+	LockSite *site;
+	for (site = lockSites; site; site = site->next) {
+		if (label ? site->label && !strcmp(site->label, label) : site->caller == caller)
+			return site;
+	}
+
+	site = calloc(1, sizeof(LockSite));
+	assert(site);
+	site->label = label;
+	site->caller = label ? NULL : caller;
+	if (label)
+		snprintf(site->name, sizeof(site->name), "%s", label);
+	else
+		snprintf(site->name, sizeof(site->name), "%p", caller);
+	site->stats.site = site->name;
+	site->next = lockSites;
+	lockSites = site;
+	lockSiteCount++;
+	return site;
+}
+
+unsigned long lockClock()
+{
+	return __builtin_ia32_rdtsc();
+}
+
+/* charges an acquire that started at start to the lock's site */
+void lockProfileAcquire(Lock *lock, unsigned long start, bool contended)
+{
+	struct lock_stats *st = &lock->site->stats;
+	unsigned long now = __builtin_ia32_rdtsc();
+
+	st->acquires++;
+	if (contended) {
+		unsigned long wait = now - start;
+		st->contended++;
+		st->wait_cycles += wait;
+		if (wait > st->wait_max)
+			st->wait_max = wait;
+	}
+	lock->acquiredAt = now;
+}
+
+void lockProfileRelease(Lock *lock)
+{
+	struct lock_stats *st = &lock->site->stats;
+	unsigned long hold = __builtin_ia32_rdtsc() - lock->acquiredAt;
+
+	st->hold_cycles += hold;
+	if (hold > st->hold_max)
+		st->hold_max = hold;
+}
+#else
+/* profiling compiled out: these vanish from the lock paths */
+static inline unsigned long lockClock() { return 0; }
+static inline void lockProfileAcquire(Lock *lock, unsigned long start, bool contended) {
+	(void)lock;
+	(void)start;
+	(void)contended;
+}
+static inline void lockProfileRelease(Lock *lock) {
+	(void)lock;
+}
+#endif
+
+/* creates a lock profiled under site, or under caller when site is NULL */
+Lock * lockNew(const char *site, void *caller)
+{
+	int enable = schedOff();
+	Lock *lock;
+
+	lock = (Lock*)malloc(sizeof(Lock));
+	assert(lock);
+
+	lock->isLocked = false;
+	lock->wq = wait_queue_create();
+	lock->tasks = (TaskList){NULL, NULL, 0};
+#ifdef THREAD_LOCK_PROFILE
+	lock->site = lockSiteFind(site, caller);
+#else
+	(void)site;
+	(void)caller;
+#endif
+
+	schedSet(enable);
+	return lock;
+}
+
+Lock * lock_create()
+{
+	return lockNew(NULL, __builtin_return_address(0));
+}
+
+/* like lock_create, with site as the label the lock is profiled under */
+Lock * lock_create_at(const char *site)
+{
+	return lockNew(site, __builtin_return_address(0));
+}
+
+void lock_destroy(Lock *lock)
+{
+	int enable = schedOff();
+	assert(lock);
+	assert(!lock->isLocked);
+	assert(!lock->tasks.head);
+
+	wait_queue_destroy(lock->wq);
+
+	free(lock);
+	schedSet(enable);
+}
+
+void lock_acquire(Lock *lock)
+{
+	int enable = schedOff();
+	assert(lock);
+	Tid me = thread_id();
+	unsigned long start = lockClock();
+	bool contended = lock->isLocked;
+
+	// With workers, spin a little while the owner is running elsewhere, but
+	// only if we are not nested inside another critical section: the owner
+	// needs the scheduler lock to release
+	threadNode *owner = lock->isLocked ? lookupThread(lock->thread) : NULL;
+	if (owner && owner->state == RUNNING && (enable & SCHED_LOCKED)) {
+		schedSet(enable);
+		for (int i = 0; i < THREAD_LOCK_SPIN && __atomic_load_n(&lock->isLocked, __ATOMIC_RELAXED); i++)
+			__builtin_ia32_pause();
+		enable = schedOff();
+	}
+
+	// Wait until the lock is released or handed to us
+	if (lock->isLocked && lock->thread != me)
+		trace(THREAD_TRACE_LOCK_WAIT, me, (long)lock);
+	while (lock->isLocked && lock->thread != me) {
+		thread_sleep(lock->wq);
+	}
+
+	// Acquire the lock
+	currentWorker()->current->grant = NULL;
+	lock->thread = me;
+    lock->isLocked = true;
+	lockProfileAcquire(lock, start, contended);
+	trace(THREAD_TRACE_LOCK_ACQUIRE, me, (long)lock);
+
+	schedSet(enable);
+}
+
+/* like lock_acquire, but gives up after usec microseconds. returns 1 when
+ * the lock was acquired, 0 on timeout. */
+int lock_acquire_timeout(Lock *lock, long usec)
+{
+	int enable = schedOff();
+	assert(lock);
+	Tid me = thread_id();
+	unsigned long expires = timerDeadline(usec);
+	int woken = 1;
+	unsigned long start = lockClock();
+	bool contended = lock->isLocked;
+
+	// Wait until the lock is released or handed to us, or time runs out
+	if (lock->isLocked && lock->thread != me && usec > 0)
+		trace(THREAD_TRACE_LOCK_WAIT, me, (long)lock);
+	while (lock->isLocked && lock->thread != me && woken) {
+		if (usec <= 0) {
+			woken = 0;
+		} else {
+			sleepCurrent(lock->wq, expires);
+			woken = !currentWorker()->current->timedOut;
+		}
+	}
+
+	// Corner Case: Timed out with the lock still taken
+	if (lock->isLocked && lock->thread != me) {
+		schedSet(enable);
+		return 0;
+	}
+
+	// Acquire the lock
+	currentWorker()->current->grant = NULL;
+	lock->thread = me;
+    lock->isLocked = true;
+	lockProfileAcquire(lock, start, contended);
+	trace(THREAD_TRACE_LOCK_ACQUIRE, me, (long)lock);
+
+	schedSet(enable);
+	return 1;
+}
+
+/* hands a lock its holder gave up to the first waiter, thread or task,
+ * or frees it. the thread is recorded as the grantee until it runs. */
+void lockPass(Lock *lock)
+{
+	threadNode *head = lock->wq->head;
+	Task *task = lock->tasks.head;
+
+	// A sleeping thread's stamp is when it started waiting, which orders it
+	// against task_lock tasks
+	if (head && (!task || head->stamp <= task->queued)) {
+		lock->thread = head->id;
+		grantTo(head, GRANT_LOCK, lock);
+		thread_wakeup(lock->wq, 0);
+	} else if (task) {
+		// Queue the task, its runner takes the lock over
+		lock->thread = THREAD_NONE;
+		taskPush(taskListPop(&lock->tasks));
+	} else {
+		lock->isLocked = false;
+	}
+}
+
+void lock_release(Lock *lock)
+{
+	int enable = schedOff();
+	assert(lock);
+	assert(lock->isLocked && lock->thread == thread_id());
+	lockProfileRelease(lock);
+	trace(THREAD_TRACE_LOCK_RELEASE, lock->thread, (long)lock);
+
+	// Hand the lock straight to the first waiter and wake only it, so
+	// waiters are served in FIFO order and nobody wakes up to lose a race.
+	// In hand-off mode a thread taking it over runs next
+	threadNode *head = lock->wq->head;
+	Task *task = lock->tasks.head;
+	if (handOffOn && head && (!task || head->stamp <= task->queued)) {
+		lock->thread = head->id;
+		grantTo(head, GRANT_LOCK, lock);
+		unlinkNode(head);
+		Worker *w = currentWorker();
+		if (handOffOk(w, head, enable)) {
+			handOff(w, head);
+		} else {
+			// Released on the way to sleep, as in cv_wait: the new owner
+			// is still the one to run next
+			timerCancel(&head->timer);
+			trace(THREAD_TRACE_WAKEUP, thread_id(), head->id);
+			enqueueReadyFront(w, head);
+		}
+	} else {
+		lockPass(lock);
+	}
+	
+	schedSet(enable);
+}
+
+#ifdef THREAD_LOCK_PROFILE
+int lockStatsCompare(const void *a, const void *b)
+{
+	const struct lock_stats *x = a, *y = b;
+	return (x->wait_cycles < y->wait_cycles) - (x->wait_cycles > y->wait_cycles);
+}
+#endif
+
+/* fills buf with the totals of up to max lock creation sites, the most
+ * waited on first. returns the number filled, 0 when profiling is
+ * compiled out. */
+int lock_stats(struct lock_stats *buf, int max)
+{
+#ifdef THREAD_LOCK_PROFILE
+	int enable = schedOff();
+	int count = lockSiteCount;
+	struct lock_stats *all = malloc(count * sizeof(*all));
+	assert(all || !count);
+
+	int i = 0;
+	for (LockSite *site = lockSites; site; site = site->next)
+		all[i++] = site->stats;
+	schedSet(enable);
+
+	qsort(all, count, sizeof(*all), lockStatsCompare);
+	if (count > max)
+		count = max;
+	for (i = 0; i < count; i++)
+		buf[i] = all[i];
+
+	enable = schedOff();
+	free(all);
+	schedSet(enable);
+	return count;
+#else
+	(void)buf;
+	(void)max;
+	return 0;
+#endif
+}
+
+/* prints one line per lock creation site, the most waited on first */
+void lock_stats_dump(FILE *out)
+{
+#ifdef THREAD_LOCK_PROFILE
+	int enable = schedOff();
+	int max = lockSiteCount;
+	struct lock_stats *buf = malloc((max ? max : 1) * sizeof(*buf));
+	assert(buf);
+	int count = lock_stats(buf, max);
+	schedSet(enable);
+
+	fprintf(out, "%-32s %10s %10s %14s %12s %14s %12s\n", "site", "acquires",
+	        "contended", "wait_cycles", "wait_max", "hold_cycles", "hold_max");
+	for (int i = 0; i < count; i++) {
+		struct lock_stats *st = &buf[i];
+		fprintf(out, "%-32s %10lu %10lu %14lu %12lu %14lu %12lu\n", st->site,
+		        st->acquires, st->contended, st->wait_cycles, st->wait_max,
+		        st->hold_cycles, st->hold_max);
+	}
+
+	enable = schedOff();
+	free(buf);
+	schedSet(enable);
+#else
+	fprintf(out, "lock profiling is off, build with -DTHREAD_LOCK_PROFILE\n");
+#endif
+}
+
+struct cv {
+	threadQueue *wq;
+};
+
+struct cv * cv_create()
+{
+	int enable = schedOff();
+
+	struct cv *cv = (struct cv*)malloc(sizeof(struct cv));
+	assert(cv);
+	cv->wq = wait_queue_create();
+
+	schedSet(enable);
+	return cv;
+}
+
+void cv_destroy(struct cv *cv)
+{
+	int enable = schedOff();
+	assert(cv);
+	assert(!cv->wq->size);
+
+	wait_queue_destroy(cv->wq);
+	free(cv);
+
+	schedSet(enable);
+}
+
+void cv_wait(struct cv *cv, Lock *lock)
+{
+	int enable = schedOff();
+	assert(cv);
+	assert(lock);
+	//assert(lock->isLocked && lock->thread == thread_id());
+
+	lock_release(lock);
+	thread_sleep(cv->wq);
+	lock_acquire(lock);
+
+	schedSet(enable);
+}
+
+/* like cv_wait, but gives up after usec microseconds. the lock is held
+ * again on return either way. returns 1 when signaled, 0 on timeout. */
+int cv_wait_timeout(struct cv *cv, Lock *lock, long usec)
+{
+	int enable = schedOff();
+	assert(cv);
+	assert(lock);
+
+	lock_release(lock);
+	int signaled = thread_sleep_timeout(cv->wq, usec);
+	lock_acquire(lock);
+
+	schedSet(enable);
+	return signaled == 1;
+}
+
+void cv_signal(struct cv *cv, Lock *lock)
+{
+	int enabled = schedOff();
+	assert(cv);
+	assert(lock);
+
+	// In hand-off mode, a waiter could only wake up to block on the lock
+	// we hold: move it there, and lock_release hands it both at once
+	threadNode *node = cv->wq->head;
+	if (handOffOn && node && lock->isLocked && lock->thread == thread_id()) {
+		unlinkNode(node);
+		timerCancel(&node->timer);
+		enqueueNode(lock->wq, node);
+	} else {
+		thread_wakeup(cv->wq, 0);
+	}
+	schedSet(enabled);
+}
+
+void cv_broadcast(struct cv *cv, Lock *lock)
+{
+	int enabled = schedOff();
+	assert(cv);
+	assert(lock);
+
+	thread_wakeup(cv->wq, 1);
+	schedSet(enabled);
+}
+
+typedef struct rwlock {
+	unsigned int state;
+	threadQueue *readers;
+	threadQueue *writers;
+}RWLock;
+
+RWLock * rwlock_create()
+{
+	int enable = schedOff();
+	RWLock *rw;
+
+	rw = (RWLock*)malloc(sizeof(RWLock));
+	assert(rw);
+
+	rw->state = 0;
+	rw->readers = wait_queue_create();
+	rw->writers = wait_queue_create();
+
+	schedSet(enable);
+	return rw;
+}
+
+void rwlock_destroy(RWLock *rw)
+{
+	int enable = schedOff();
+	assert(rw);
+	assert(!(rw->state & ~SYNC_WAITERS));
+
+	wait_queue_destroy(rw->readers);
+	wait_queue_destroy(rw->writers);
+	free(rw);
+
+	schedSet(enable);
+}
+
+void rwlock_read_acquire(RWLock *rw)
+{
+	assert(rw);
+
+	for (;;) {
+		unsigned int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+
+		// Writer preference: readers queue up behind waiting writers
+		if (!(s & RW_WRITER) && (!(s & SYNC_WAITERS) || !rw->writers->size)) {
+			if (__atomic_compare_exchange_n(&rw->state, &s, s + 1, true,
+			        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		// Woken up holding a read share
+		if (syncSleep(&rw->state, s, rw->readers))
+			return;
+	}
+}
+
+void rwlock_write_acquire(RWLock *rw)
+{
+	assert(rw);
+
+	for (;;) {
+		unsigned int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+
+		if (!(s & ~SYNC_WAITERS)) {
+			if (__atomic_compare_exchange_n(&rw->state, &s, s | RW_WRITER, true,
+			        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		// Woken up holding the lock
+		if (syncSleep(&rw->state, s, rw->writers))
+			return;
+	}
+}
+
+/* hands the free lock to the next writer, or else to every reader, and
+ * wakes them. woken threads do not have to retry, so a writer arriving in
+ * between cannot send a crowd of readers back to sleep. */
+void rwlockWake(RWLock *rw)
+{
+	int enable = schedOff();
+	unsigned int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	unsigned int grant;
+	bool writer = rw->writers->size > 0;
+
+	if (writer)
+		grant = RW_WRITER | (rw->writers->size > 1 || rw->readers->size ? SYNC_WAITERS : 0);
+	else
+		grant = rw->readers->size;
+
+	// A writer may have barged in since the release, its release wakes them
+	if (s == SYNC_WAITERS && __atomic_compare_exchange_n(&rw->state, &s, grant, false,
+	        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		if (writer) {
+			grantTo(rw->writers->head, GRANT_WRITE, rw);
+			thread_wakeup(rw->writers, 0);
+		} else {
+			// Every reader gets a share, recorded once for the batch
+			trace(THREAD_TRACE_WAKEUP_ALL, thread_id(), rw->readers->size);
+			wokenAdd(currentWorker(), rw->readers, GRANT_READ, rw);
+		}
+	}
+
+	schedSet(enable);
+}
+
+void rwlock_read_release(RWLock *rw)
+{
+	assert(rw);
+	unsigned int s = __atomic_sub_fetch(&rw->state, 1, __ATOMIC_RELEASE);
+
+	// Last reader out with threads waiting
+	if (s == SYNC_WAITERS)
+		rwlockWake(rw);
+}
+
+void rwlock_write_release(RWLock *rw)
+{
+	assert(rw);
+	unsigned int s = __atomic_and_fetch(&rw->state, ~RW_WRITER, __ATOMIC_RELEASE);
+
+	if (s == SYNC_WAITERS)
+		rwlockWake(rw);
+}
+
+typedef struct semaphore {
+	unsigned int state;
+	threadQueue *wq;
+}Semaphore;
+
+Semaphore * semaphore_create(int value)
+{
+	assert(value >= 0 && (unsigned int)value < RW_WRITER);
+	int enable = schedOff();
+	Semaphore *sem;
+
+	sem = (Semaphore*)malloc(sizeof(Semaphore));
+	assert(sem);
+
+	sem->state = value;
+	sem->wq = wait_queue_create();
+
+	schedSet(enable);
+	return sem;
 }
 
-/*
- * Function 4.1 Init
- * Get First Running Thread
- * */
-void thread_init(void)
+void semaphore_destroy(Semaphore *sem)
 {
-	// Create the first thread
-    threadNode *curr = (threadNode*) malloc(sizeof(threadNode));
-    curr->id = 0;
-    curr->next = NULL;
-    curr->stackPtr = NULL;
-    threads[0] = RUNNING;
-    getcontext(&curr->context);
+	int enable = schedOff();
+	assert(sem);
+	assert(!sem->wq->size);
 
-	// Initialize the queue sizes
-	readyQueue.size = 0;
-    exitQueue.size = 0;
+	wait_queue_destroy(sem->wq);
+	free(sem);
 
-	// Add thread to the ready queue
-    enqueueNode(&readyQueue, curr);
+	schedSet(enable);
 }
 
-/*
- * Function 4.2 Get Thread ID
- * */
-Tid thread_id()
+int semaphore_try_down(Semaphore *sem)
 {
-	return readyQueue.head->id;
+	assert(sem);
+	unsigned int s = __atomic_load_n(&sem->state, __ATOMIC_RELAXED);
+
+	while (s & ~SYNC_WAITERS) {
+		if (__atomic_compare_exchange_n(&sem->state, &s, s - 1, true,
+		        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	}
+	return 0;
 }
 
-/*
- * Function 4.3 Create
- * None->Ready
- * */
-Tid thread_create(void (*fn) (void *), void *parg)
+void semaphore_down(Semaphore *sem)
 {
-	int enabled = interrupts_off();
+	assert(sem);
 
-	// Find an available thread id
-	Tid id = minAvailableID();
-	if (id == THREAD_MAX_THREADS) {
-		interrupts_set(enabled);
-		return THREAD_NOMORE;
-	}
+	while (!semaphore_try_down(sem)) {
+		unsigned int s = __atomic_load_n(&sem->state, __ATOMIC_RELAXED);
 
-    // Step 1. Create new threads at tail
-    threadNode *curr = (threadNode*) malloc(sizeof(threadNode));
-	if (curr == NULL) {
-		interrupts_set(enabled);
-		return THREAD_NOMEMORY;
+		// Only sleep if no unit came back since the try; a woken thread
+		// has been handed the unit
+		if (!(s & ~SYNC_WAITERS) && syncSleep(&sem->state, s, sem->wq))
+			return;
 	}
+}
 
-    // Step 2. Assign Members
-	curr->id = id;
-	curr->stackPtr = malloc(THREAD_MIN_STACK);
+void semaphore_up(Semaphore *sem)
+{
+	assert(sem);
+	unsigned int s = __atomic_load_n(&sem->state, __ATOMIC_RELAXED);
 
-	// Corner Case 2. No memory available for thread stackPtr
-    if (curr->stackPtr == NULL) {
-        free(curr);
-        interrupts_set(enabled);
-        return THREAD_NOMEMORY;
-    }
+	// Nobody asleep: just return the unit
+	while (!(s & SYNC_WAITERS)) {
+		if (__atomic_compare_exchange_n(&sem->state, &s, s + 1, true,
+		        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
 
-	getcontext(&curr->context);
+	int enable = schedOff();
 
-    curr->context.uc_mcontext.gregs[REG_RDI] = (long long int)fn;
-    curr->context.uc_mcontext.gregs[REG_RSI] = (long long int)parg;
-    curr->context.uc_mcontext.gregs[REG_RSP] = (long long int)curr->stackPtr + THREAD_MIN_STACK - 8;
-    curr->context.uc_mcontext.gregs[REG_RIP] = (long long int)&thread_stub;
+	if (sem->wq->size) {
+		// Hand the unit straight to the first waiter
+		if (sem->wq->size == 1)
+			__atomic_and_fetch(&sem->state, ~SYNC_WAITERS, __ATOMIC_RELAXED);
+		grantTo(sem->wq->head, GRANT_UNIT, sem);
+		thread_wakeup(sem->wq, 0);
+	} else {
+		// Nobody went to sleep after all
+		s = __atomic_load_n(&sem->state, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&sem->state, &s, (s + 1) & ~SYNC_WAITERS, true,
+		        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
 
-	// Add newly created thread to the end of the ready queue
-	enqueueNode(&readyQueue, curr);
+	schedSet(enable);
+}
 
-	// Thread id of newly created thread is now taken
-	threads[id] = READY;
+/* gives back what a retired thread was handed but never took, as if it
+ * had taken and released it */
+void grantRevoke(threadNode *node)
+{
+	void *obj = node->grant;
+	node->grant = NULL;
 
-	interrupts_set(enabled);
-	return id;
+	switch (node->grantKind) {
+	case GRANT_LOCK: {
+		Lock *lock = obj;
+		if (lock->isLocked && lock->thread == node->id)
+			lockPass(lock);
+		break;
+	}
+	case GRANT_READ:
+		rwlock_read_release(obj);
+		break;
+	case GRANT_WRITE:
+		rwlock_write_release(obj);
+		break;
+	case GRANT_UNIT:
+		semaphore_up(obj);
+		break;
+	}
 }
 
-/*
- * Function 4.5 Yield
- * Running->Ready & Ready->Running
- * */
-Tid thread_yield(Tid want_tid) {
-    int enable = interrupts_off();
+Chan * chan_create(int capacity)
+{
+	assert(capacity > 0);
+	int enable = schedOff();
+	Chan *ch;
 
-    freeQueue(&exitQueue);
+	ch = (Chan*)malloc(sizeof(Chan) + capacity * sizeof(void *));
+	assert(ch);
 
-    threadNode *wantThread, *currentThread = readyQueue.head;
+	ch->capacity = capacity;
+	ch->head = ch->count = 0;
+	ch->closed = false;
+	ch->senders.head = ch->senders.tail = NULL;
+	ch->receivers.head = ch->receivers.tail = NULL;
 
-    // Case 1. Want Current Running Thread
-    // Let running thread continue running
-    if (want_tid == THREAD_SELF || want_tid == readyQueue.head->id) {
-        wantThread = readyQueue.head;
-        want_tid = readyQueue.head->id;
-    } else if (want_tid == THREAD_ANY) {
-        // Case 2. Want Any Ready Thread
-        // Get Ready Queue Head and let it run
-        if (readyQueue.size == 1) {
-            interrupts_set(enable);
-            return THREAD_NONE;
-        }
+	schedSet(enable);
+	return ch;
+}
 
-        wantThread = readyQueue.head->next;
-        want_tid = wantThread->id;
+void chan_destroy(Chan *ch)
+{
+	int enable = schedOff();
+	assert(ch);
+	assert(!ch->senders.head && !ch->receivers.head);
 
-        // Move current thread to end of ready queue
-        enqueueEnd(&readyQueue);
-    } else {
-        // Case 3. Want Specific Ready Thread
-        // Get the want ID thread and let it run
-        threadNode *prev;
-
-        if (readyQueue.head->id == want_tid) {
-            prev = NULL;
-            wantThread = readyQueue.head;
-        } else{
-            threadNode* current = readyQueue.head;
-
-            while (current->next != NULL) {
-                if (current->next->id == want_tid)
-                    break;
-                current = current->next;
-            }
+	free(ch);
+	schedSet(enable);
+}
 
-            prev = current;
-            wantThread = current->next;
-        }
+/* no more sends are accepted. blocked senders fail, receivers get what is
+ * still buffered and then fail. */
+void chan_close(Chan *ch)
+{
+	int enable = schedOff();
+	assert(ch);
 
-        if (!wantThread) {
-            interrupts_set(enable);
-            return THREAD_INVALID;
-        }
+	ch->closed = true;
+	while (ch->senders.head)
+		chanComplete(ch->senders.head, false);
+	while (ch->receivers.head)
+		chanComplete(ch->receivers.head, false);
 
-        // Move current thread to end of ready queue
-        enqueueEnd(&readyQueue);
-        enqueueHead(&readyQueue, wantThread, prev);
-    }
+	schedSet(enable);
+}
 
-    // Flag to check if returning from a different thread
-    volatile bool isCalled = false;
+int chan_send(Chan *ch, void *item)
+{
+	struct chan_case c = {ch, 1, item, 0};
+	int enable = schedOff();
+	assert(ch);
 
-    // Set current thread to ready state
-    if (threads[currentThread->id] != EXIT) {
-        threads[currentThread->id] = READY;
-    }
+	int ret = chanSelect(&c, 1, true);
 
-    // Save context for current thread
-    getcontext(&currentThread->context);
+	schedSet(enable);
+	return ret < 0 ? ret : c.ok ? 0 : THREAD_INVALID;
+}
 
-    // Returning to this thread from a different thread
-    if (!isCalled) {
-        isCalled = true;
-        setcontext(&wantThread->context);
-    }
+int chan_recv(Chan *ch, void **item)
+{
+	struct chan_case c = {ch, 0, NULL, 0};
+	int enable = schedOff();
+	assert(ch);
 
-    if (threads[readyQueue.head->id] == EXIT){
-        thread_exit();
-    }else {
-        threads[readyQueue.head->id] = RUNNING;
-    }
+	int ret = chanSelect(&c, 1, true);
+	*item = c.item;
 
-	interrupts_set(enable);
-	return want_tid;
+	schedSet(enable);
+	return ret < 0 ? ret : c.ok ? 0 : THREAD_INVALID;
 }
 
-/*
- * Function 4.6 Exit
- * Running->Exit
- * */
-void thread_exit()
+int chan_try_send(Chan *ch, void *item)
 {
-    int enable = interrupts_off();
-	threads[thread_id()] = EXIT;
+	int enable = schedOff();
+	assert(ch);
 
-	// Wakeup all threads waiting on this thread's exit
-	thread_wakeup(waitQueue[thread_id()], 1);
+	int ret = chanTrySend(ch, item);
 
-	// Delete the wait queue for this thread
-	wait_queue_destroy(waitQueue[thread_id()]);
-    waitQueue[thread_id()] = NULL;
+	schedSet(enable);
+	return ret;
+}
 
-	// Pop head of ready queue
-    threadNode* exitThread = dequeue(&readyQueue);
+int chan_try_recv(Chan *ch, void **item)
+{
+	int enable = schedOff();
+	assert(ch);
 
-	if (!readyQueue.head) {
-		// This is the last running thread.
-        freeQueue(&exitQueue);
+	int ret = chanTryRecv(ch, item);
 
-		for (int i = 0; i < THREAD_MAX_THREADS; ++i){
-            wait_queue_destroy(waitQueue[i]);
-		}
+	schedSet(enable);
+	return ret;
+}
 
-		// Deallocate memory for this thread
-        free(exitThread->stackPtr);
-		free(exitThread);
+/* sends every item in order under one critical section, blocking while
+ * the channel is full. returns how many were sent, fewer than count only
+ * if the channel was closed. */
+int chan_send_batch(Chan *ch, void **items, int count)
+{
+	int enable = schedOff();
+	assert(ch);
+	int sent = 0;
 
-        interrupts_set(enable);
-		exit(0);
+	while (sent < count) {
+		int ret = chanTrySend(ch, items[sent]);
+		if (ret == THREAD_NONE) {
+			struct chan_case c = {ch, 1, items[sent], 0};
+			if (chanSelect(&c, 1, true) < 0 || !c.ok)
+				break;
+		} else if (ret < 0) {
+			break;
+		}
+		sent++;
 	}
 
-	// Append exited thread to exit queue
-    enqueueNode(&exitQueue, exitThread);
-	setcontext(&readyQueue.head->context);
-    interrupts_set(enable);
+	schedSet(enable);
+	return sent;
 }
 
-/*
- * Function 4.7 Kill
- * Ready->Exit
- * */
-Tid thread_kill(Tid tid)
+/* blocks until at least one item is there and takes up to max. returns
+ * how many were received, 0 once the channel is closed and drained. */
+int chan_recv_batch(Chan *ch, void **items, int max)
 {
-	int enable = interrupts_off();
+	int enable = schedOff();
+	assert(ch);
+	int received = 0;
 
-    // Corner Case: Invalid ID
-	if (tid < 0 || tid >= THREAD_MAX_THREADS ||
-	    tid == thread_id() || !threads[tid]){
-		interrupts_set(enable);
-		return THREAD_INVALID;
+	if (max > 0) {
+		struct chan_case c = {ch, 0, NULL, 0};
+		if (chanSelect(&c, 1, true) >= 0 && c.ok) {
+			items[received++] = c.item;
+			while (received < max && !chanTryRecv(ch, &items[received]))
+				received++;
+		}
 	}
 
-    // Common Case: Insert Wanted Thread to Exit Queue
-    threads[tid] = EXIT;
-	interrupts_set(enable);
-	return tid;
+	schedSet(enable);
+	return received;
 }
 
-/*******************************************************************
- * Important: The rest of the code should be implemented in Lab 3. *
- *******************************************************************/
-/* make sure to fill the wait_queue structure defined above */
-struct wait_queue * wait_queue_create()
+int chan_select(struct chan_case *cases, int count, int block)
 {
-	struct wait_queue *wq;
+	if (count < 1)
+		return THREAD_INVALID;
 
-	wq = malloc(sizeof(struct wait_queue));
-	assert(wq);
+	int enable = schedOff();
+	int ret = chanSelect(cases, count, block);
+	schedSet(enable);
+	return ret;
+}
 
-	wq->size = 0;
-	wq->head = NULL;
-	wq->tail = NULL;
+/* tasks ready to run, and the runner threads sleeping until there are */
+TaskList taskQueue = {NULL, NULL, 0};
+struct wait_queue taskIdle = {0, NULL, NULL};
+int taskRunners = 0;
 
-	return wq;
+void taskListPush(TaskList *list, Task *task)
+{
+	task->next = NULL;
+	if (list->tail)
+		list->tail->next = task;
+	else
+		list->head = task;
+	list->tail = task;
+	list->size++;
 }
 
-void wait_queue_destroy(struct wait_queue *wq)
+Task *taskListPop(TaskList *list)
 {
-    freeQueue(wq);
-	free(wq);
+	Task *task = list->head;
+	if (task) {
+		list->head = task->next;
+		if (!list->head)
+			list->tail = NULL;
+		list->size--;
+	}
+	return task;
 }
 
-Tid thread_sleep(struct wait_queue *queue)
+/* appends every task of src to the run queue in O(1) */
+void taskListSplice(TaskList *src)
 {
-	int enabled = interrupts_off();
-
-	// Corner Case 1. Invalid Queue
-	if (!queue) {
-		interrupts_set(enabled);
-		return THREAD_INVALID;
-	}
-    // Corner Case 2. No ready Thread
-	if (readyQueue.size <= 1) {
-		interrupts_set(enabled);
-		return THREAD_NONE;
-	}
+	if (!src->head)
+		return;
+	if (taskQueue.tail)
+		taskQueue.tail->next = src->head;
+	else
+		taskQueue.head = src->head;
+	taskQueue.tail = src->tail;
+	taskQueue.size += src->size;
+	*src = (TaskList){NULL, NULL, 0};
+}
 
-	threadNode *currentThread = dequeue(&readyQueue);
-    enqueueNode(queue, currentThread);
+/* runs queued tasks until none is left and none can be queued any more */
+void taskRunner(void *unused)
+{
+	int enable = schedOff();
 
-    threadNode *newThread = readyQueue.head;
-	int ret = newThread->id;
+	for (;;) {
+		Task *task = taskListPop(&taskQueue);
+		if (!task) {
+			if (thread_sleep(&taskIdle) == THREAD_NONE)
+				break;
+			continue;
+		}
 
-    // Check if returns from another thread
-	volatile bool isCalled = false;
+		// The lock was handed to the task while it was queued
+		if (task->owns) {
+			task->owns->thread = thread_id();
+			lockProfileAcquire(task->owns, 0, false);
+			trace(THREAD_TRACE_LOCK_ACQUIRE, thread_id(), (long)task->owns);
+		}
+		schedSet(enable);
 
-    threads[currentThread->id] = SLEEP;
-	getcontext(&currentThread->context);
+		if (task->fn)
+			task->fn(task->arg);
+		else if (task->then)
+			task->then(task->arg, task->future);
+		else
+			future_resolve(task->result, task->async(task->arg));
+		if (task->future)
+			future_release(task->future);
+		if (task->result)
+			future_release(task->result);
 
-	if (!isCalled) {
-        isCalled = true;
-        setcontext(&newThread->context);
+		enable = schedOff();
+		free(task);
 	}
 
-    if (threads[readyQueue.head->id] == EXIT){
-        thread_exit();
-    }else {
-        threads[readyQueue.head->id] = RUNNING;
-    }
-	
-	interrupts_set(enabled);
-	return ret;
+	taskRunners--;
+	schedSet(enable);
 }
 
-/* when the 'all' parameter is 1, wakeup all threads waiting in the queue.
- * returns whether a thread was woken up on not. */
-int thread_wakeup(threadQueue *queue, int all)
+/* queues a task to run and gets a runner to it, starting the first runner
+ * on demand. runs inside a scheduler critical section. */
+void taskPush(Task *task)
 {
-	int enabled = interrupts_off();
+	taskListPush(&taskQueue, task);
+	if (taskIdle.size)
+		thread_wakeup(&taskIdle, 0);
+	else if (!taskRunners)
+		task_start_runners(1);
+}
 
-    // Corner Case: Invalid or empty queue
-	if (!queue || !queue->size) {
-		interrupts_set(enabled);
-		return 0;
-	}
+Task *taskNew()
+{
+	int enable = schedOff();
+	Task *task = calloc(1, sizeof(Task));
+	schedSet(enable);
+	return task;
+}
 
-	int count = 0;
-	// Case 1. wake up one
-	if(!all){
-        threadNode *node = dequeue(queue);
+/* sets the outcome of f and queues its continuations; waiting threads
+ * wake up all at once. runs inside a scheduler critical section. */
+int futureSettle(Future *f, int state, void *value)
+{
+	if (f->state != FUTURE_PENDING)
+		return THREAD_INVALID;
 
-        if(threads[node->id] != EXIT){
-            threads[node->id] = READY;
-        }
+	f->state = state;
+	f->value = value;
 
-        enqueueNode(&readyQueue, node);
-		count++;
-	}else{
-	    // Case 2. Wake up all
-        threadNode *node;
-        while(queue->head){
-            node = dequeue(queue);
+	int count = f->then.size;
+	taskListSplice(&f->then);
+	if (count && !taskRunners)
+		task_start_runners(1);
+	if (count)
+		thread_wakeup(&taskIdle, count > 1);
+	thread_wakeup(&f->waiters, 1);
+	return 0;
+}
 
-            if(threads[node->id] != EXIT){
-                threads[node->id] = READY;
-            }
+/* timer of a future_sleep future ran out */
+void futureTimerFire(FutureTimer *ft)
+{
+	futureSettle(ft->future, FUTURE_RESOLVED, NULL);
+	future_release(ft->future);
+	free(ft);
+}
 
-            enqueueNode(&readyQueue, node);
-            count++;
-        }
-	}
+/* a future_send or future_recv completed, ok is false when the channel
+ * was closed */
+void futureChanDone(ChanWaiter *cw, bool ok)
+{
+	WaiterList *list = cw->list;
 
-	interrupts_set(enabled);
-	return count;
+	if (cw->prev)
+		cw->prev->next = cw->next;
+	else
+		list->head = cw->next;
+	if (cw->next)
+		cw->next->prev = cw->prev;
+	else
+		list->tail = cw->prev;
+
+	futureSettle(cw->future, ok ? FUTURE_RESOLVED : FUTURE_FAILED, ok ? cw->item : NULL);
+	future_release(cw->future);
+	free(cw);
 }
 
-/* suspend current thread until Thread tid exits */
-Tid thread_wait(Tid tid)
+/* starts count more runner threads. returns how many were started. */
+int task_start_runners(int count)
 {
-	int enabled = interrupts_off();
+	struct thread_attr attr;
+	char name[THREAD_NAME_MAX];
+	int started = 0;
 
-    // Corner Cases
-	if (tid < 0 || tid == thread_id() || !threads[tid]) {
-		interrupts_set(enabled);
-		return THREAD_INVALID;
-	}
+	thread_attr_init(&attr);
+	attr.detached = 1;
+	attr.name = name;
 
-	// Common Cases
-	int ret_id = tid;
-	threadQueue *wq = waitQueue[tid];
-	if (!wq) {
-        waitQueue[tid] = wait_queue_create();
-		wq = waitQueue[tid];
+	int enable = schedOff();
+	for (; started < count; started++) {
+		snprintf(name, sizeof(name), "task-%d", taskRunners);
+		if (thread_create_ex(taskRunner, NULL, &attr) < 0)
+			break;
+		taskRunners++;
 	}
-
-	thread_sleep(wq);
-	interrupts_set(enabled);
-	return ret_id;
+	schedSet(enable);
+	return started;
 }
 
-typedef struct lock {
-	bool isLocked;
-	Tid thread;
-	threadQueue *wq;
-}Lock;
-
-Lock * lock_create()
+/* number of runner threads alive */
+int task_runners()
 {
-	int enable = interrupts_off();
-	Lock *lock;
-
-	lock = (Lock*)malloc(sizeof(Lock));
-	assert(lock);
+	return taskRunners;
+}
 
-	lock->isLocked = false;
-	lock->wq = wait_queue_create();
+int task_spawn(void (*fn)(void *), void *arg)
+{
+	Task *task = taskNew();
+	if (!task)
+		return THREAD_NOMEMORY;
+	task->fn = fn;
+	task->arg = arg;
 
-	interrupts_set(enable);
-	return lock;
+	int enable = schedOff();
+	taskPush(task);
+	schedSet(enable);
+	return 0;
 }
 
-void lock_destroy(Lock *lock)
+/* the lock is taken right away when it is free, otherwise the task waits
+ * its turn with the threads sleeping on the lock */
+int task_lock(Lock *lock, void (*fn)(void *), void *arg)
 {
-	int enable = interrupts_off();
-	assert(lock);
-	assert(!lock->isLocked);
+	Task *task = taskNew();
+	if (!task)
+		return THREAD_NOMEMORY;
+	task->fn = fn;
+	task->arg = arg;
+	task->owns = lock;
 
-	wait_queue_destroy(lock->wq);
+	int enable = schedOff();
+	if (lock->isLocked) {
+		task->queued = __builtin_ia32_rdtsc();
+		taskListPush(&lock->tasks, task);
+	} else {
+		lock->isLocked = true;
+		lock->thread = THREAD_NONE;
+		taskPush(task);
+	}
+	schedSet(enable);
+	return 0;
+}
 
-	free(lock);
-	interrupts_set(enable);
+Future *future_create()
+{
+	int enable = schedOff();
+	Future *f = calloc(1, sizeof(Future));
+	if (f)
+		f->refs = 1;
+	schedSet(enable);
+	return f;
 }
 
-void lock_acquire(Lock *lock)
+void future_release(Future *f)
 {
-	int enable = interrupts_off();
-	assert(lock);
+	int enable = schedOff();
+	assert(f && f->refs > 0);
 
-	// Wait until lock is released
-	while (lock->isLocked) {
-		thread_sleep(lock->wq);
+	if (!--f->refs) {
+		assert(!f->waiters.size);
+		free(f);
 	}
+	schedSet(enable);
+}
 
-	// Acquire the lock
-	lock->thread = thread_id();
-    lock->isLocked = true;
-
-	interrupts_set(enable);
+int future_resolve(Future *f, void *value)
+{
+	int enable = schedOff();
+	int ret = futureSettle(f, FUTURE_RESOLVED, value);
+	schedSet(enable);
+	return ret;
 }
 
-void lock_release(Lock *lock)
+int future_fail(Future *f)
 {
-	int enable = interrupts_off();
-	assert(lock);
-	assert(lock->isLocked && lock->thread == thread_id());
+	int enable = schedOff();
+	int ret = futureSettle(f, FUTURE_FAILED, NULL);
+	schedSet(enable);
+	return ret;
+}
 
-	// Release the lock
-	lock->isLocked = false;
+/* fn runs as a task once f is settled, right away if it already is */
+int future_then(Future *f, void (*fn)(void *, Future *), void *arg)
+{
+	Task *task = taskNew();
+	if (!task)
+		return THREAD_NOMEMORY;
+	task->then = fn;
+	task->arg = arg;
+	task->future = f;
 
-	// Wake up all threads waiting on the lock
-	thread_wakeup(lock->wq, 1);	
-	
-	interrupts_set(enable);
+	int enable = schedOff();
+	f->refs++;
+	if (f->state == FUTURE_PENDING)
+		taskListPush(&f->then, task);
+	else
+		taskPush(task);
+	schedSet(enable);
+	return 0;
 }
 
-struct cv {
-	threadQueue *wq;
-};
+int future_get(Future *f, void **value)
+{
+	int enable = schedOff();
+	int ret = f->state == FUTURE_PENDING ? THREAD_NONE
+	        : f->state == FUTURE_FAILED ? THREAD_INVALID : 0;
+	if (!ret && value)
+		*value = f->value;
+	schedSet(enable);
+	return ret;
+}
 
-struct cv * cv_create()
+/* blocks the calling thread until f is settled */
+int future_wait(Future *f, void **value)
 {
-	int enable = interrupts_off();
+	int enable = schedOff();
 
-	struct cv *cv = (struct cv*)malloc(sizeof(struct cv));
-	assert(cv);
-	cv->wq = wait_queue_create();
+	while (f->state == FUTURE_PENDING) {
+		if (thread_sleep(&f->waiters) == THREAD_NONE) {
+			schedSet(enable);
+			return THREAD_NONE;
+		}
+	}
+	int ret = future_get(f, value);
 
-	interrupts_set(enable);
-	return cv;
+	schedSet(enable);
+	return ret;
 }
 
-void cv_destroy(struct cv *cv)
+Future *future_async(void *(*fn)(void *), void *arg)
 {
-	int enable = interrupts_off();
-	assert(cv);
-	assert(!cv->wq->size);
-
-	wait_queue_destroy(cv->wq);
-	free(cv);
+	Future *f = future_create();
+	Task *task = taskNew();
 
-	interrupts_set(enable);
+	int enable = schedOff();
+	if (!f || !task) {
+		free(f);
+		free(task);
+		schedSet(enable);
+		return NULL;
+	}
+	task->async = fn;
+	task->arg = arg;
+	task->result = f;
+	f->refs++;
+	taskPush(task);
+	schedSet(enable);
+	return f;
 }
 
-void cv_wait(struct cv *cv, Lock *lock)
+Future *future_sleep(long usec)
 {
-	int enable = interrupts_off();
-	assert(cv);
-	assert(lock);
-	//assert(lock->isLocked && lock->thread == thread_id());
+	if (usec < 0)
+		return NULL;
 
-	lock_release(lock);
-	thread_sleep(cv->wq);
-	lock_acquire(lock);
+	int enable = schedOff();
+	Future *f = future_create();
+	FutureTimer *ft = malloc(sizeof(FutureTimer));
+	if (!f || !ft) {
+		free(f);
+		free(ft);
+		schedSet(enable);
+		return NULL;
+	}
 
-	interrupts_set(enable);
+	if (!usec) {
+		futureSettle(f, FUTURE_RESOLVED, NULL);
+		free(ft);
+	} else {
+		ft->future = f;
+		ft->timer.thread = NULL;
+		f->refs++;
+		timerAdd(&ft->timer, timerDeadline(usec));
+	}
+	schedSet(enable);
+	return f;
 }
 
-void cv_signal(struct cv *cv, Lock *lock)
+/* completes right away when the channel is ready, or queues a waiter with
+ * no thread that settles f when a peer or chan_close completes it */
+Future *futureChan(Chan *ch, bool send, void *item)
 {
-	int enabled = interrupts_off();
-	assert(cv);
-	assert(lock);
+	int enable = schedOff();
+	Future *f = future_create();
+	ChanWaiter *cw = malloc(sizeof(ChanWaiter));
+	if (!f || !cw) {
+		free(f);
+		free(cw);
+		schedSet(enable);
+		return NULL;
+	}
 
-	thread_wakeup(cv->wq, 0);
-	interrupts_set(enabled);
+	int ret = send ? chanTrySend(ch, item) : chanTryRecv(ch, &item);
+
+	if (ret == THREAD_NONE) {
+		cw->thread = NULL;
+		cw->future = f;
+		cw->index = 0;
+		cw->item = item;
+		f->refs++;
+		chanEnqueue(send ? &ch->senders : &ch->receivers, cw);
+	} else {
+		futureSettle(f, ret ? FUTURE_FAILED : FUTURE_RESOLVED, ret ? NULL : item);
+		free(cw);
+	}
+	schedSet(enable);
+	return f;
 }
 
-void cv_broadcast(struct cv *cv, Lock *lock)
+Future *future_send(Chan *ch, void *item)
 {
-	int enabled = interrupts_off();
-	assert(cv);
-	assert(lock);
+	return futureChan(ch, true, item);
+}
 
-	thread_wakeup(cv->wq, 1);
-	interrupts_set(enabled);
+Future *future_recv(Chan *ch)
+{
+	return futureChan(ch, false, NULL);
 }
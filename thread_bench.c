@@ -0,0 +1,373 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "thread.h"
+#include "interrupt.h"
+#include "thread_ext.h"
+
+/*
+ * Microbenchmarks for the thread library
+ * Usage: thread_bench [-p] [-w workers] [-n ops] [workload...]
+ * Each workload runs over a range of thread counts and reports ns/op and
+ * ops/sec. Without workload names every workload is run. -p turns on
+ * timer preemption.
+ * */
+
+/* Section 1. Shared State */
+static long opsPerRun = 200000;
+static int threadCounts[] = {2, 8, 32, 128, 512};
+
+static Tid peer;
+static long iterations;
+static struct lock *lock;
+static struct rwlock *rwlock;
+static struct chan *chan;
+static struct cv *notFull, *notEmpty;
+static struct future *done;
+static long counter;
+
+/* Bounded buffer for the producer-consumer workload */
+#define BUFFER_SIZE 16
+static long buffer[BUFFER_SIZE];
+static int bufferHead, bufferCount;
+
+// Function 1. Time in nanoseconds
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Function 2. Print one result line
+static void report(const char *name, int threads, long ops, double ns){
+    printf("%-10s %8d %10ld %12.1f %14.0f\n", name, threads, ops, ns / ops,
+           ops / (ns / 1e9));
+}
+
+// Function 3. Wait for every thread in tids
+static void joinAll(Tid *tids, int n){
+    for(int i = 0; i < n; i++){
+        thread_wait(tids[i]);
+    }
+}
+
+/* Section 2. Thread Bodies */
+static void pingBody(void *arg){
+    for(long i = 0; i < iterations; i++){
+        thread_yield(0);
+    }
+}
+
+static void yieldBody(void *arg){
+    for(long i = 0; i < iterations; i++){
+        thread_yield(THREAD_ANY);
+    }
+}
+
+static void exitBody(void *arg){
+}
+
+static void lockBody(void *arg){
+    for(long i = 0; i < iterations; i++){
+        lock_acquire(lock);
+        counter++;
+        // Give up the CPU inside the critical section now and then, so
+        // the other threads find the lock taken
+        if(i % 4 == 0) thread_yield(THREAD_ANY);
+        lock_release(lock);
+    }
+}
+
+static void rwlockBody(void *arg){
+    for(long i = 0; i < iterations; i++){
+        // One write for every fifteen reads
+        if(i % 16 == 0){
+            rwlock_write_acquire(rwlock);
+            counter++;
+            rwlock_write_release(rwlock);
+        } else{
+            rwlock_read_acquire(rwlock);
+            if(i % 4 == 1) thread_yield(THREAD_ANY);
+            rwlock_read_release(rwlock);
+        }
+    }
+}
+
+static void producerBody(void *arg){
+    for(long i = 0; i < iterations; i++){
+        lock_acquire(lock);
+        while(bufferCount == BUFFER_SIZE) cv_wait(notFull, lock);
+        buffer[(bufferHead + bufferCount++) % BUFFER_SIZE] = i;
+        cv_signal(notEmpty, lock);
+        lock_release(lock);
+    }
+}
+
+static void consumerBody(void *arg){
+    for(long i = 0; i < iterations; i++){
+        lock_acquire(lock);
+        while(bufferCount == 0) cv_wait(notEmpty, lock);
+        counter += buffer[bufferHead];
+        bufferHead = (bufferHead + 1) % BUFFER_SIZE;
+        bufferCount--;
+        cv_signal(notFull, lock);
+        lock_release(lock);
+    }
+}
+
+static void senderBody(void *arg){
+    for(long i = 0; i < iterations; i++){
+        chan_send(chan, (void *)i);
+    }
+}
+
+static void receiverBody(void *arg){
+    void *item;
+    for(long i = 0; i < iterations; i++){
+        chan_recv(chan, &item);
+        counter += (long)item;
+    }
+}
+
+static void taskBody(void *arg){
+    if(__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED) == iterations) future_resolve(done, NULL);
+}
+
+/* Section 3. Workloads */
+// Workload 1. Directed yield between the main thread and one peer
+static void benchPingPong(int threads){
+    if(threads != 2) return;
+
+    iterations = opsPerRun / 2;
+    peer = thread_create(pingBody, NULL);
+    assert(thread_ret_ok(peer));
+
+    double start = now();
+    for(long i = 0; i < iterations; i++){
+        thread_yield(peer);
+    }
+    double ns = now() - start;
+
+    thread_wait(peer);
+    report("pingpong", threads, iterations * 2, ns);
+}
+
+// Workload 2. N threads yielding to any thread
+static void benchRoundRobin(int threads){
+    Tid tids[threads];
+    iterations = opsPerRun / threads;
+
+    double start = now();
+    for(int i = 0; i < threads; i++){
+        tids[i] = thread_create(yieldBody, NULL);
+        assert(thread_ret_ok(tids[i]));
+    }
+    joinAll(tids, threads);
+    double ns = now() - start;
+
+    report("yield", threads, iterations * threads, ns);
+}
+
+// Workload 3. Create batches of threads that exit right away
+static void benchChurn(int threads){
+    long rounds = opsPerRun / 4 / threads + 1;
+
+    double start = now();
+    for(long r = 0; r < rounds; r++){
+        for(int i = 0; i < threads; i++){
+            assert(thread_ret_ok(thread_create(exitBody, NULL)));
+        }
+        while(thread_yield(THREAD_ANY) != THREAD_NONE);
+    }
+    double ns = now() - start;
+
+    report("churn", threads, rounds * threads, ns);
+}
+
+// Workload 4. N threads contending for one lock
+static void benchLock(int threads){
+    Tid tids[threads];
+    iterations = opsPerRun / threads;
+    counter = 0;
+    lock = lock_create();
+
+    double start = now();
+    for(int i = 0; i < threads; i++){
+        tids[i] = thread_create(lockBody, NULL);
+        assert(thread_ret_ok(tids[i]));
+    }
+    joinAll(tids, threads);
+    double ns = now() - start;
+
+    assert(counter == iterations * threads);
+    lock_destroy(lock);
+    report("lock", threads, counter, ns);
+}
+
+// Workload 5. N threads on a read-mostly reader-writer lock
+static void benchRWLock(int threads){
+    Tid tids[threads];
+    iterations = opsPerRun / threads;
+    counter = 0;
+    rwlock = rwlock_create();
+
+    double start = now();
+    for(int i = 0; i < threads; i++){
+        tids[i] = thread_create(rwlockBody, NULL);
+        assert(thread_ret_ok(tids[i]));
+    }
+    joinAll(tids, threads);
+    double ns = now() - start;
+
+    assert(counter == (iterations + 15) / 16 * threads);
+    rwlock_destroy(rwlock);
+    report("rwlock", threads, iterations * threads, ns);
+}
+
+// Workload 6. N/2 producers and N/2 consumers on a bounded buffer
+static void benchProducerConsumer(int threads){
+    Tid tids[threads];
+    iterations = opsPerRun / threads;
+    counter = bufferHead = bufferCount = 0;
+    lock = lock_create();
+    notFull = cv_create();
+    notEmpty = cv_create();
+
+    double start = now();
+    for(int i = 0; i < threads; i++){
+        tids[i] = thread_create(i % 2 ? consumerBody : producerBody, NULL);
+        assert(thread_ret_ok(tids[i]));
+    }
+    joinAll(tids, threads);
+    double ns = now() - start;
+
+    assert(counter == threads / 2 * (iterations * (iterations - 1) / 2));
+    cv_destroy(notFull);
+    cv_destroy(notEmpty);
+    lock_destroy(lock);
+    report("prodcons", threads, iterations * (threads / 2), ns);
+}
+
+// Workload 7. The producer-consumer workload over a channel
+static void benchChannel(int threads){
+    Tid tids[threads];
+    iterations = opsPerRun / threads;
+    counter = 0;
+    chan = chan_create(BUFFER_SIZE);
+
+    double start = now();
+    for(int i = 0; i < threads; i++){
+        tids[i] = thread_create(i % 2 ? receiverBody : senderBody, NULL);
+        assert(thread_ret_ok(tids[i]));
+    }
+    joinAll(tids, threads);
+    double ns = now() - start;
+
+    assert(counter == threads / 2 * (iterations * (iterations - 1) / 2));
+    chan_destroy(chan);
+    report("chan", threads, iterations * (threads / 2), ns);
+}
+
+// Workload 8. The main thread joins N threads that exit right away
+static void benchJoin(int threads){
+    Tid tids[threads];
+    long rounds = opsPerRun / 4 / threads + 1;
+
+    double start = now();
+    for(long r = 0; r < rounds; r++){
+        for(int i = 0; i < threads; i++){
+            tids[i] = thread_create(exitBody, NULL);
+            assert(thread_ret_ok(tids[i]));
+        }
+        joinAll(tids, threads);
+    }
+    double ns = now() - start;
+
+    report("join", threads, rounds * threads, ns);
+}
+
+// Workload 9. Fan out stackless tasks over N runner threads
+static void benchTask(int threads){
+    iterations = opsPerRun;
+    counter = 0;
+    if(threads > task_runners()) task_start_runners(threads - task_runners());
+    done = future_create();
+
+    double start = now();
+    for(long i = 0; i < iterations; i++){
+        assert(task_spawn(taskBody, NULL) == 0);
+    }
+    assert(future_wait(done, NULL) == 0);
+    double ns = now() - start;
+
+    future_release(done);
+    report("task", threads, iterations, ns);
+}
+
+static struct {
+    const char *name;
+    void (*run)(int threads);
+} workloads[] = {
+    {"pingpong", benchPingPong},
+    {"yield", benchRoundRobin},
+    {"churn", benchChurn},
+    {"lock", benchLock},
+    {"rwlock", benchRWLock},
+    {"prodcons", benchProducerConsumer},
+    {"chan", benchChannel},
+    {"join", benchJoin},
+    {"task", benchTask},
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+#define NCOUNTS (sizeof(threadCounts) / sizeof(threadCounts[0]))
+
+// Function 0. Input Handling
+static void usage(){
+    fprintf(stderr, "Usage: thread_bench [-p] [-w workers] [-n ops] [workload...]\n");
+    fprintf(stderr, "Workloads: pingpong yield churn lock rwlock prodcons chan join task\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int workers = 1, opt;
+    bool preempt = false;
+
+    while((opt = getopt(argc, argv, "pw:n:")) != -1){
+        switch(opt){
+            case 'p': preempt = true; break;
+            case 'w': workers = atoi(optarg); break;
+            case 'n': opsPerRun = atol(optarg); break;
+            default: usage();
+        }
+    }
+    if(workers < 1 || opsPerRun < 1) usage();
+
+    thread_init();
+    if(preempt) register_interrupt_handler(0);
+    if(workers > 1 && thread_start_workers(workers) != workers){
+        fprintf(stderr, "thread_bench: could not start %d workers\n", workers);
+        exit(1);
+    }
+
+    printf("%-10s %8s %10s %12s %14s\n", "workload", "threads", "ops", "ns/op", "ops/sec");
+    for(unsigned w = 0; w < NWORKLOADS; w++){
+        bool wanted = optind == argc;
+        for(int i = optind; i < argc; i++){
+            if(!strcmp(argv[i], workloads[w].name)) wanted = true;
+        }
+        if(!wanted) continue;
+
+        for(unsigned c = 0; c < NCOUNTS; c++){
+            workloads[w].run(threadCounts[c]);
+        }
+    }
+
+    return 0;
+}
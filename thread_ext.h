@@ -0,0 +1,416 @@
+#ifndef _THREAD_EXT_H_
+#define _THREAD_EXT_H_
+
+#include <stdio.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "thread.h"
+
+/* Extensions to the thread library declared in thread.h */
+
+/* Maximum number of kernel threads running green threads */
+#ifndef THREAD_MAX_WORKERS
+#define THREAD_MAX_WORKERS 64
+#endif
+
+/* Runs green threads on count kernel threads (M:N mode). Each worker has
+ * its own run queue, under a lock of its own. Idle workers park until a
+ * thread is queued, then steal ready threads from busy ones without the
+ * scheduler lock. Threads run in parallel between calls into the library;
+ * the library's own state is still under one scheduler lock, but it is
+ * not held across the context switch itself. Timer ticks are passed on to
+ * every worker running a thread.
+ * Must be called by the only live thread, right after thread_init().
+ * Returns the number of workers started, or THREAD_INVALID. */
+Tid thread_start_workers(int count);
+
+/* Sets how many threads may exist at once, THREAD_MAX_THREADS by default.
+ * The Tid tables grow on demand up to this limit. Returns the previous
+ * limit, or THREAD_INVALID. */
+int thread_set_max_threads(int max);
+
+/* Scheduling policies. FIFO is plain round robin. PRIORITY always runs the
+ * best static priority first. MLFQ starts threads at their static priority
+ * and demotes them one level each time they are preempted. */
+enum { THREAD_SCHED_FIFO = 0, THREAD_SCHED_PRIORITY = 1, THREAD_SCHED_MLFQ = 2 };
+
+/* Priority levels, 0 is the highest; at most 32 */
+#ifndef THREAD_PRIO_LEVELS
+#define THREAD_PRIO_LEVELS 32
+#endif
+#define THREAD_PRIO_DEFAULT (THREAD_PRIO_LEVELS / 2)
+
+/* Preemptions between two MLFQ priority boosts */
+#ifndef THREAD_MLFQ_BOOST
+#define THREAD_MLFQ_BOOST 64
+#endif
+
+/* Selects the scheduling policy. Returns the previous one, or
+ * THREAD_INVALID. */
+int thread_set_policy(int policy);
+
+/* Hand-off scheduling, off by default. When on, lock_release switches
+ * straight to the waiter it hands the lock to, and the releaser runs again
+ * right after it; the waiter gets the rest of the current quantum. A
+ * cv_signal under the lock moves the waiter to the lock, so the
+ * lock_release that follows wakes it in one switch. Threads of a worse
+ * level than the releaser or another ready thread are woken as usual.
+ * Returns the previous setting. */
+int thread_set_handoff(int on);
+
+/* Sets the static priority of thread tid (or THREAD_SELF). Returns the
+ * previous priority, or THREAD_INVALID. */
+int thread_set_priority(Tid tid, int priority);
+
+/* Thread attributes for thread_create_ex */
+#define THREAD_NAME_MAX 16
+/* Smallest stack handed out. The timer signal is delivered on the
+ * running thread's stack, so it must hold a signal frame, whose size
+ * depends on the CPU's register state, on top of 8 KB for the thread. */
+#ifndef THREAD_STACK_FLOOR
+#define THREAD_STACK_FLOOR (MINSIGSTKSZ + 8192)
+#endif
+
+struct thread_attr {
+	size_t stack_size;	/* bytes, 0 for THREAD_MIN_STACK */
+	const char *name;	/* copied, truncated to THREAD_NAME_MAX - 1 */
+	int priority;		/* initial static priority */
+	int detached;		/* nobody can thread_wait on it */
+	int joinable;		/* keeps its id and exit value after exiting,
+				 * until joined or detached */
+};
+
+/* Fills attr with the defaults thread_create uses. */
+void thread_attr_init(struct thread_attr *attr);
+
+/* Like thread_create, with attributes; attr may be NULL. Stacks are
+ * reserved but only take memory as the thread touches them. Returns the
+ * new Tid, THREAD_INVALID for bad attributes, THREAD_NOMORE or
+ * THREAD_NOMEMORY. */
+Tid thread_create_ex(void (*fn) (void *), void *arg, const struct thread_attr *attr);
+
+/* Exits the calling thread like thread_exit, with ret as its exit value.
+ * Threads that return from their function or are killed exit with NULL. */
+void thread_exit_value(void *ret);
+
+/* Like thread_wait, and stores the exit value of tid in ret unless ret is
+ * NULL. Other threads give up their id when they exit, so as with
+ * thread_wait they must still be live; a joinable thread can be joined
+ * after it exited. Returns tid, THREAD_INVALID, or THREAD_NONE when tid
+ * could never exit. */
+Tid thread_join(Tid tid, void **ret);
+
+/* Lets tid (or THREAD_SELF) be freed as soon as it exits, without being
+ * waited for; an exited joinable thread is freed right away. Returns tid,
+ * or THREAD_INVALID when it is not live, already detached, or a thread is
+ * waiting for it. */
+Tid thread_detach(Tid tid);
+
+/* Per-thread scheduler statistics. Times are in TSC cycles and include
+ * the interval the thread is in at the time of the snapshot. */
+enum { THREAD_STATE_READY = 1, THREAD_STATE_RUNNING = 2, THREAD_STATE_SLEEP = 3 };
+
+struct thread_stats {
+	Tid id;
+	char name[THREAD_NAME_MAX];
+	int state;
+	int priority;
+	unsigned long switches;		/* times switched in */
+	unsigned long voluntary;	/* yields and sleeps */
+	unsigned long preempted;	/* timer preemptions */
+	unsigned long run_cycles;
+	unsigned long ready_cycles;
+	unsigned long sleep_cycles;
+};
+
+/* Fills buf with up to max live threads. Returns the number filled. */
+int thread_stats(struct thread_stats *buf, int max);
+
+/* Prints one line of statistics per live thread. */
+void thread_stats_dump(FILE *out);
+
+/* Scheduler trace. While on, scheduling events are recorded into a ring
+ * holding the last THREAD_TRACE_EVENTS of them; while off, each event
+ * point costs one branch. thread_trace_dump writes a header and the events
+ * oldest first, for thread_trace2json to turn into a Chrome trace. */
+enum {
+	THREAD_TRACE_CREATE = 1,	/* tid created arg */
+	THREAD_TRACE_YIELD,		/* tid gave the CPU to arg */
+	THREAD_TRACE_PREEMPT,		/* tid was preempted by arg */
+	THREAD_TRACE_SLEEP,		/* tid slept, arg runs next or THREAD_NONE */
+	THREAD_TRACE_WAKEUP,		/* tid woke arg up */
+	THREAD_TRACE_WAKEUP_ALL,	/* tid woke arg threads up */
+	THREAD_TRACE_EXIT,		/* tid exited, arg runs next or THREAD_NONE */
+	THREAD_TRACE_KILL,		/* tid killed arg */
+	THREAD_TRACE_LOCK_WAIT,		/* tid waits for lock arg */
+	THREAD_TRACE_LOCK_ACQUIRE,	/* tid acquired lock arg */
+	THREAD_TRACE_LOCK_RELEASE,	/* tid released lock arg */
+};
+
+#define THREAD_TRACE_MAGIC "THRTRACE"
+#define THREAD_TRACE_VERSION 1
+
+struct thread_trace_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int count;		/* events that follow */
+	double cycles_per_us;		/* TSC rate measured over the trace */
+};
+
+struct thread_trace_event {
+	unsigned long stamp;		/* TSC */
+	long arg;
+	int tid;
+	short type;
+	short worker;
+};
+
+void thread_trace_start();
+void thread_trace_stop();
+
+/* Returns the number of events written, THREAD_NOMEMORY or
+ * THREAD_FAILED. */
+int thread_trace_dump(FILE *out);
+
+/* Timed blocking. Timeouts are in microseconds and run on a timer wheel
+ * that is advanced by the timer interrupt, by yields while timers are
+ * pending, and by idle workers, so they are accurate to about one
+ * interrupt interval. */
+
+/* Suspends the calling thread for at least usec microseconds. Returns 0,
+ * or THREAD_INVALID for a negative usec. */
+int thread_sleep_for(long usec);
+
+/* Like thread_sleep, but gives up after usec microseconds. Returns 1 when
+ * woken up, 0 on timeout, or THREAD_INVALID. Like thread_sleep, returns
+ * THREAD_NONE without sleeping when nothing could ever wake the caller. */
+int thread_sleep_timeout(struct wait_queue *queue, long usec);
+
+/* Like lock_acquire, but gives up after usec microseconds; 0 only tries.
+ * Returns 1 when the lock was acquired, 0 on timeout. */
+int lock_acquire_timeout(struct lock *lock, long usec);
+
+/* Like cv_wait, but gives up after usec microseconds. The lock is held
+ * again on return either way. Returns 1 when signaled, 0 on timeout or
+ * when the wait could not sleep at all. */
+int cv_wait_timeout(struct cv *cv, struct lock *lock, long usec);
+
+/* Entry point for the interrupt layer's timer handler, in place of
+ * thread_yield(THREAD_ANY): the yield is taken as a preemption, and the
+ * tick is passed on to the other workers. Returns as thread_yield, or
+ * THREAD_NONE when preemption is off or the tick was deferred. */
+Tid thread_preempt();
+
+/* Timer hook the interrupt layer may provide: runs its timer with a
+ * period of usec microseconds, or stops it for 0. */
+void interrupts_tick(long usec) __attribute__((weak));
+
+/* With interrupts_tick, preemption is tickless: after the first tick
+ * through thread_preempt, the library stops the timer once a whole period
+ * passed with no thread waiting to run and no timed or I/O wait pending,
+ * and restarts it when that changes. Without it the timer keeps its own
+ * period. Sets the timer period in microseconds, 0 to turn preemption
+ * off. Returns the previous period, or THREAD_INVALID. */
+long thread_set_quantum(long usec);
+
+/* Thread-local storage. Every thread has THREAD_KEYS_MAX slots, NULL until
+ * set. When a thread exits, the destructor of each key it has a non-NULL
+ * value for is called with that value, on the exiting thread. Threads
+ * killed before they run again skip the destructors. */
+#ifndef THREAD_KEYS_MAX
+#define THREAD_KEYS_MAX 32
+#endif
+
+/* Returns a new key, or THREAD_NOMORE. destructor may be NULL. */
+int thread_key_create(void (*destructor)(void *));
+
+/* Frees key for reuse and clears its value in every thread. Destructors
+ * are not called. Returns 0, or THREAD_INVALID. */
+int thread_key_delete(int key);
+
+/* Value of key in the calling thread, NULL if unset or invalid. */
+void *thread_getspecific(int key);
+
+/* Sets the value of key in the calling thread. Returns 0, or
+ * THREAD_INVALID. */
+int thread_setspecific(int key, void *value);
+
+/* Waiting on an address, as with futex(2). Sleepers are kept in a fixed
+ * table of THREAD_WAIT_BUCKETS queues hashed by address, so a primitive
+ * built on these needs nothing but the word it waits on. */
+#ifndef THREAD_WAIT_BUCKETS
+#define THREAD_WAIT_BUCKETS 256
+#endif
+
+/* Suspends the calling thread while *addr still holds expected, until
+ * thread_wake_addr(addr) wakes it. The check and the sleep are atomic with
+ * respect to thread_wake_addr. Returns 0 when woken up, 1 when *addr held
+ * another value, THREAD_NONE when no other thread could wake it, or
+ * THREAD_INVALID for a NULL addr. */
+int thread_wait_on(const int *addr, int expected);
+
+/* Wakes up to count threads waiting on addr, oldest first. Returns the
+ * number woken up. */
+int thread_wake_addr(const int *addr, int count);
+
+/* Thread-aware I/O. These park only the calling thread until epoll
+ * reports the fd ready; they otherwise behave like read(2), write(2) and
+ * accept(2). Sockets are read and written with MSG_DONTWAIT and keep their
+ * flags. Other fds, and sockets passed to thread_accept, are switched to
+ * O_NONBLOCK on first use; thread_close switches them back, since the
+ * flag is shared with every process holding the same open file. Ttys,
+ * such as an inherited stdin, and fds epoll cannot poll, such as regular
+ * files, are left alone and get plain blocking calls. The poller runs on
+ * the timer interrupt, whenever a worker runs out of ready threads, and at
+ * least every THREAD_IO_POLL_EVERY scheduling decisions. An fd used with
+ * them must be closed with thread_close. */
+ssize_t thread_read(int fd, void *buf, size_t count);
+ssize_t thread_write(int fd, const void *buf, size_t count);
+
+/* Accepted sockets are non-blocking and close-on-exec. */
+int thread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/* Removes fd from the poller, wakes its waiters and closes it. */
+int thread_close(int fd);
+
+/* Lock contention profiling. Built with -DTHREAD_LOCK_PROFILE (the library
+ * and its users alike), every lock is charged to the site it was created
+ * at: "file:line" for lock_create calls compiled with this header, the
+ * caller's address otherwise. Without it the counting compiles out and
+ * lock_stats returns 0. Times are in TSC cycles. */
+struct lock_stats {
+	const char *site;
+	unsigned long acquires;
+	unsigned long contended;	/* acquires that found the lock taken */
+	unsigned long wait_cycles;
+	unsigned long wait_max;
+	unsigned long hold_cycles;
+	unsigned long hold_max;
+};
+
+/* Like lock_create, profiled under site. */
+struct lock *lock_create_at(const char *site);
+
+#ifdef THREAD_LOCK_PROFILE
+#define THREAD_STR_(x) #x
+#define THREAD_STR(x) THREAD_STR_(x)
+#define lock_create() lock_create_at(__FILE__ ":" THREAD_STR(__LINE__))
+#endif
+
+/* Fills buf with up to max sites, the largest total wait first. Returns
+ * the number filled. */
+int lock_stats(struct lock_stats *buf, int max);
+
+/* Prints one line per site, the largest total wait first. */
+void lock_stats_dump(FILE *out);
+
+/* Writer-preferring reader-writer lock. Any number of readers or one
+ * writer hold it; once a writer waits, new readers queue behind it.
+ * Uncontended acquires and releases do not enter the scheduler. */
+struct rwlock *rwlock_create();
+void rwlock_destroy(struct rwlock *rw);
+void rwlock_read_acquire(struct rwlock *rw);
+void rwlock_read_release(struct rwlock *rw);
+void rwlock_write_acquire(struct rwlock *rw);
+void rwlock_write_release(struct rwlock *rw);
+
+/* Counting semaphore. down takes a unit, sleeping until one is available;
+ * try_down returns 1 if it got one, 0 otherwise; up returns a unit. */
+struct semaphore *semaphore_create(int value);
+void semaphore_destroy(struct semaphore *sem);
+void semaphore_down(struct semaphore *sem);
+int semaphore_try_down(struct semaphore *sem);
+void semaphore_up(struct semaphore *sem);
+
+/* Bounded multi-producer multi-consumer channel of pointers. Every item
+ * sent wakes at most one blocked receiver, and every slot freed at most
+ * one blocked sender. Calls that would block forever, with no other
+ * thread left to complete them, return THREAD_NONE. */
+struct chan *chan_create(int capacity);
+void chan_destroy(struct chan *ch);
+
+/* Blocked senders fail; receivers drain what is buffered, then fail. */
+void chan_close(struct chan *ch);
+
+/* Return 0, or THREAD_INVALID when the channel is closed (and, for
+ * receives, drained). The try versions return THREAD_NONE instead of
+ * blocking. */
+int chan_send(struct chan *ch, void *item);
+int chan_recv(struct chan *ch, void **item);
+int chan_try_send(struct chan *ch, void *item);
+int chan_try_recv(struct chan *ch, void **item);
+
+/* Send all count items, blocking while full; returns the number sent.
+ * Receive between 1 and max items, blocking until there is one; returns
+ * the number received, 0 once closed and drained. */
+int chan_send_batch(struct chan *ch, void **items, int count);
+int chan_recv_batch(struct chan *ch, void **items, int max);
+
+/* One operation of chan_select. item is sent, or set to what was
+ * received; ok is set to 0 if the case completed because the channel was
+ * closed. */
+struct chan_case {
+	struct chan *chan;
+	int send;
+	void *item;
+	int ok;
+};
+
+/* Completes exactly one ready case, or blocks until one is ready unless
+ * block is 0. Returns its index, or THREAD_NONE. */
+int chan_select(struct chan_case *cases, int count, int block);
+
+/* Stackless tasks. A task is a function run to completion by one of a
+ * few runner threads, so it costs an allocation instead of a stack. It
+ * must not block for long: waiting is done by chaining a continuation on
+ * a future instead. Runners are started on demand; a task that blocks
+ * anyway only holds up its runner. */
+
+/* Starts count more runner threads. Returns how many were started. */
+int task_start_runners(int count);
+
+/* Number of runner threads alive. A runner exits once no task is queued
+ * and nothing is left that could queue one. */
+int task_runners();
+
+/* Runs fn(arg) as a task. Returns 0, or THREAD_NOMEMORY. */
+int task_spawn(void (*fn)(void *), void *arg);
+
+/* Runs fn(arg) as a task holding lock, taking turns with the threads
+ * waiting for it. fn must release the lock before it returns. Returns 0, or
+ * THREAD_NOMEMORY. */
+int task_lock(struct lock *lock, void (*fn)(void *), void *arg);
+
+/* A value that is set once: resolved with a value, or failed. The creator
+ * holds a reference and drops it with future_release; continuations,
+ * timers and channels keep their own until they are done with it. */
+struct future *future_create();
+void future_release(struct future *f);
+
+/* Settle f and queue its continuations. Return 0, or THREAD_INVALID when f
+ * was already settled. */
+int future_resolve(struct future *f, void *value);
+int future_fail(struct future *f);
+
+/* Runs fn(arg, f) as a task once f is settled. Returns 0, or
+ * THREAD_NOMEMORY. */
+int future_then(struct future *f, void (*fn)(void *arg, struct future *f), void *arg);
+
+/* Returns 0 and sets value when f was resolved, THREAD_INVALID when it
+ * failed, THREAD_NONE while it is pending. future_wait blocks the calling
+ * thread until f is settled, or returns THREAD_NONE when it never could
+ * be. */
+int future_get(struct future *f, void **value);
+int future_wait(struct future *f, void **value);
+
+/* Futures settled by the library, NULL when out of memory. future_async
+ * resolves with what fn(arg), run as a task, returns; future_sleep with
+ * NULL after usec microseconds. future_send and future_recv resolve once
+ * the channel took the item or delivered one, and fail if it is closed. */
+struct future *future_async(void *(*fn)(void *), void *arg);
+struct future *future_sleep(long usec);
+struct future *future_send(struct chan *ch, void *item);
+struct future *future_recv(struct chan *ch);
+
+#endif /* _THREAD_EXT_H_ */
@@ -0,0 +1,155 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "thread.h"
+#include "thread_ext.h"
+
+/*
+ * Converts a scheduler trace written by thread_trace_dump to the Chrome
+ * trace event format, for chrome://tracing or ui.perfetto.dev
+ * Usage: thread_trace2json [trace] > trace.json
+ * Each green thread gets a track showing when it ran, with the scheduling
+ * events as instants. Lock waits and holds are drawn as async spans, so
+ * convoys show up as stacks of waits on one lock.
+ * */
+
+/* Section 1. State */
+static struct thread_trace_header hdr;
+static unsigned long firstStamp;
+static bool first = true;
+
+/* Thread each worker runs and since when, -1 when unknown */
+static int running[THREAD_MAX_WORKERS];
+static double runningSince[THREAD_MAX_WORKERS];
+
+static const char *names[] = {
+    [THREAD_TRACE_CREATE] = "create",
+    [THREAD_TRACE_YIELD] = "yield",
+    [THREAD_TRACE_PREEMPT] = "preempt",
+    [THREAD_TRACE_SLEEP] = "sleep",
+    [THREAD_TRACE_WAKEUP] = "wakeup",
+    [THREAD_TRACE_WAKEUP_ALL] = "wakeup_all",
+    [THREAD_TRACE_EXIT] = "exit",
+    [THREAD_TRACE_KILL] = "kill",
+    [THREAD_TRACE_LOCK_WAIT] = "lock_wait",
+    [THREAD_TRACE_LOCK_ACQUIRE] = "lock_acquire",
+    [THREAD_TRACE_LOCK_RELEASE] = "lock_release",
+};
+
+// Function 1. Microseconds since the first event
+static double usec(unsigned long stamp){
+    return (stamp - firstStamp) / hdr.cycles_per_us;
+}
+
+// Function 2. Start a JSON object, comma separated from the previous one
+static void begin(){
+    printf(first ? "\n" : ",\n");
+    first = false;
+}
+
+// Function 3. Close the slice tid has been running on worker w
+static void endSlice(int w, double ts){
+    if(running[w] < 0) return;
+    begin();
+    printf("{\"name\":\"run\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+           "\"dur\":%.3f,\"args\":{\"worker\":%d}}",
+           running[w], runningSince[w], ts - runningSince[w], w);
+    running[w] = -1;
+}
+
+// Function 4. Thread tid starts running on worker w
+static void startSlice(int w, int tid, double ts){
+    endSlice(w, ts);
+    if(tid < 0) return;
+    running[w] = tid;
+    runningSince[w] = ts;
+}
+
+// Function 5. Emit one event
+static void convert(struct thread_trace_event *ev){
+    int w = ev->worker;
+    double ts = usec(ev->stamp);
+    const char *name = ev->type > 0 && ev->type <= THREAD_TRACE_LOCK_RELEASE ? names[ev->type] : "unknown";
+
+    if(w < 0 || w >= THREAD_MAX_WORKERS) w = 0;
+
+    // The running thread is only known from the events it records
+    if(running[w] != ev->tid){
+        startSlice(w, ev->tid, ts);
+    }
+
+    begin();
+    if(ev->type >= THREAD_TRACE_LOCK_WAIT){
+        printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%d,"
+               "\"ts\":%.3f,\"args\":{\"lock\":\"%#lx\"}}", name, ev->tid, ts, ev->arg);
+    } else{
+        printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%d,"
+               "\"ts\":%.3f,\"args\":{\"arg\":%ld}}", name, ev->tid, ts, ev->arg);
+    }
+
+    switch(ev->type){
+        case THREAD_TRACE_YIELD:
+        case THREAD_TRACE_PREEMPT:
+        case THREAD_TRACE_SLEEP:
+        case THREAD_TRACE_EXIT:
+            startSlice(w, (int)ev->arg, ts);
+            break;
+        case THREAD_TRACE_LOCK_WAIT:
+            begin();
+            printf("{\"name\":\"wait\",\"cat\":\"lock\",\"ph\":\"b\",\"id\":\"%#lx-%d\","
+                   "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", ev->arg, ev->tid, ev->tid, ts);
+            break;
+        case THREAD_TRACE_LOCK_ACQUIRE:
+            begin();
+            printf("{\"name\":\"wait\",\"cat\":\"lock\",\"ph\":\"e\",\"id\":\"%#lx-%d\","
+                   "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", ev->arg, ev->tid, ev->tid, ts);
+            begin();
+            printf("{\"name\":\"hold\",\"cat\":\"lock\",\"ph\":\"b\",\"id\":\"%#lx\","
+                   "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", ev->arg, ev->tid, ts);
+            break;
+        case THREAD_TRACE_LOCK_RELEASE:
+            begin();
+            printf("{\"name\":\"hold\",\"cat\":\"lock\",\"ph\":\"e\",\"id\":\"%#lx\","
+                   "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", ev->arg, ev->tid, ts);
+            break;
+    }
+}
+
+// Function 0. Input Handling
+int
+main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    struct thread_trace_event ev;
+
+    if(argc > 2 || (argc == 2 && !(in = fopen(argv[1], "rb")))){
+        fprintf(stderr, "Usage: thread_trace2json [trace] > trace.json\n");
+        exit(1);
+    }
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+       memcmp(hdr.magic, THREAD_TRACE_MAGIC, sizeof(hdr.magic)) ||
+       hdr.version != THREAD_TRACE_VERSION || hdr.cycles_per_us <= 0){
+        fprintf(stderr, "thread_trace2json: not a thread trace\n");
+        exit(1);
+    }
+
+    for(int w = 0; w < THREAD_MAX_WORKERS; w++){
+        running[w] = -1;
+    }
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    double last = 0;
+    for(unsigned int i = 0; i < hdr.count && fread(&ev, sizeof(ev), 1, in) == 1; i++){
+        if(i == 0) firstStamp = ev.stamp;
+        convert(&ev);
+        last = usec(ev.stamp);
+    }
+
+    // Close the slices still running at the end of the trace
+    for(int w = 0; w < THREAD_MAX_WORKERS; w++){
+        endSlice(w, last);
+    }
+    printf("\n]}\n");
+    return 0;
+}